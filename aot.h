@@ -0,0 +1,118 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+
+using namespace llvm;
+
+// 提前编译: 把整个module写成目标文件、汇编或bitcode, 之后可以直接链接进
+// C++程序, 执行时不需要JIT和LLVM运行库
+class AOTCompiler
+{
+public:
+    enum FileType
+    {
+        FILE_OBJECT,
+        FILE_ASSEMBLY,
+        FILE_BITCODE
+    };
+
+private:
+    std::unique_ptr<TargetMachine> tm;
+
+public:
+    AOTCompiler(std::unique_ptr<TargetMachine> tm) : tm(std::move(tm)) {}
+
+    // 为宿主的target triple创建编译器, cpu为"native"时针对本机CPU及其特性调优
+    static Expected<std::unique_ptr<AOTCompiler>> Create(StringRef cpu, unsigned optLevel)
+    {
+        std::string triple = sys::getProcessTriple();
+        std::string error;
+        const Target *target = TargetRegistry::lookupTarget(triple, error);
+        if (target == nullptr)
+        {
+            return make_error<StringError>(error, inconvertibleErrorCode());
+        }
+        std::string cpu_name = cpu.str();
+        SubtargetFeatures features;
+        if (cpu == "native")
+        {
+            cpu_name = sys::getHostCPUName().str();
+            StringMap<bool> host_features;
+            if (sys::getHostCPUFeatures(host_features))
+            {
+                for (auto &feature : host_features)
+                {
+                    features.AddFeature(feature.first(), feature.second);
+                }
+            }
+        }
+        static const CodeGenOpt::Level levels[] = {
+            CodeGenOpt::None, CodeGenOpt::Less, CodeGenOpt::Default, CodeGenOpt::Aggressive};
+        // 生成位置无关代码, 目标文件既能链接进可执行文件也能链接进共享库
+        std::unique_ptr<TargetMachine> tm(target->createTargetMachine(
+            triple, cpu_name, features.getString(), TargetOptions(), Reloc::PIC_, None,
+            levels[optLevel]));
+        if (!tm)
+        {
+            return make_error<StringError>("cannot create a target machine for " + triple,
+                                           inconvertibleErrorCode());
+        }
+        return std::make_unique<AOTCompiler>(std::move(tm));
+    }
+
+    DataLayout dataLayout() const
+    {
+        return tm->createDataLayout();
+    }
+
+    TargetMachine &targetMachine() { return *tm; }
+
+    Error emit(Module &module, StringRef path, FileType type)
+    {
+        module.setTargetTriple(tm->getTargetTriple().str());
+        module.setDataLayout(tm->createDataLayout());
+
+        std::error_code ec;
+        raw_fd_ostream os(path, ec, type == FILE_ASSEMBLY ? sys::fs::OF_Text : sys::fs::OF_None);
+        if (ec)
+        {
+            return createFileError(path, ec);
+        }
+        if (type == FILE_BITCODE)
+        {
+            WriteBitcodeToFile(module, os);
+        }
+        else
+        {
+            legacy::PassManager pass_manager;
+            if (tm->addPassesToEmitFile(pass_manager, os, nullptr,
+                                        type == FILE_OBJECT ? CGFT_ObjectFile : CGFT_AssemblyFile))
+            {
+                return make_error<StringError>("the target cannot emit this file type",
+                                               inconvertibleErrorCode());
+            }
+            pass_manager.run(module);
+        }
+        os.flush();
+        if (os.has_error())
+        {
+            return createFileError(path, os.error());
+        }
+        return Error::success();
+    }
+};
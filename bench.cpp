@@ -0,0 +1,375 @@
+
+#include <chrono>
+#include <functional>
+
+#include "engine.h"
+
+// kaleidoscope的吞吐量基准测试: 生成指定规模的合成源码，分别测量
+// 词法分析、语法分析、IR生成的吞吐量以及JIT执行的调用延迟
+
+cl::OptionCategory g_bench_category("kal_bench options");
+
+cl::opt<unsigned> g_size("size", cl::desc("Number of items in each generated workload"),
+                         cl::init(20000), cl::cat(g_bench_category));
+
+cl::opt<unsigned> g_repeat("repeat", cl::desc("Run each measurement N times and keep the fastest"),
+                           cl::init(3), cl::cat(g_bench_category));
+
+cl::opt<unsigned> g_calls("calls", cl::desc("Number of calls in the call latency measurements"),
+                          cl::init(1000000), cl::cat(g_bench_category));
+
+cl::opt<unsigned> g_fib("fib", cl::desc("Argument of the recursive fib(n) call latency measurement"),
+                       cl::init(30), cl::cat(g_bench_category));
+
+cl::opt<unsigned> g_bench_opt_level("bench-O", cl::desc("Optimization level used by the codegen measurement"),
+                                    cl::init(0), cl::cat(g_bench_category));
+
+//
+
+// 每个函数体都是较长的混合优先级表达式
+string generateDeepExprs(unsigned count)
+{
+    string source;
+    for (unsigned i = 0; i < count / 100 + 1; i++)
+    {
+        source += "def deep" + to_string(i) + "(x y)\n    x";
+        for (unsigned j = 0; j < 100; j++)
+        {
+            static const char *const terms[] = {
+                " + y * 3", " - x * y", " + (x - 1.5) * (y + 2)", " < y", " + x * x * 0.5"};
+            source += terms[j % 5];
+        }
+        source += "\n";
+    }
+    return source;
+}
+
+// 大量短小的函数定义
+string generateManyDefs(unsigned count)
+{
+    string source;
+    for (unsigned i = 0; i < count; i++)
+    {
+        source += "def f" + to_string(i) + "(a b) a * b + " + to_string(i) + "\n";
+    }
+    return source;
+}
+
+// 很长的extern声明列表
+string generateExterns(unsigned count)
+{
+    string source;
+    for (unsigned i = 0; i < count; i++)
+    {
+        source += "extern e" + to_string(i) + "(a b c)\n";
+    }
+    return source;
+}
+
+// 函数定义加上对它们的调用
+string generateCalls(unsigned count)
+{
+    string source = "def add(a b) a + b\ndef mul(a b) a * b\n";
+    for (unsigned i = 0; i < count; i++)
+    {
+        source += "add(mul(" + to_string(i) + ", 2), add(1, " + to_string(i) + "))\n";
+    }
+    return source;
+}
+
+struct Workload
+{
+    const char *name;
+    string source;
+};
+
+//
+
+// 重复执行func，返回最快一次的耗时(秒)
+double bestOf(const function<void()> &func)
+{
+    double best = 1e100;
+    for (unsigned i = 0; i < max(1u, (unsigned)g_repeat); i++)
+    {
+        auto start = chrono::steady_clock::now();
+        func();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        best = min(best, seconds);
+    }
+    return best;
+}
+
+void report(const char *measure, const char *workload, uint64_t count, const char *unit, double seconds)
+{
+    outs() << format("%-10s %-12s %10llu %-8s %10.3f ms %10.3f M%s/s\n",
+                     measure, workload, (unsigned long long)count, unit,
+                     seconds * 1e3, count / seconds / 1e6, unit);
+}
+
+size_t countNodes(const ExprAST *expr)
+{
+    switch (expr->kind())
+    {
+    case EXPR_NUMBER:
+    case EXPR_VARIABLE:
+        return 1;
+    case EXPR_BINARY:
+    {
+        auto *binary = cast<BinaryExprAST>(expr);
+        return 1 + countNodes(binary->lhs()) + countNodes(binary->rhs());
+    }
+    case EXPR_CALL:
+    {
+        size_t count = 1;
+        for (const ExprAST *arg : cast<CallExprAST>(expr)->args())
+        {
+            count += countNodes(arg);
+        }
+        return count;
+    }
+    case EXPR_IF:
+    {
+        auto *branch = cast<IfExprAST>(expr);
+        return 1 + countNodes(branch->cond()) + countNodes(branch->thenExpr()) +
+               countNodes(branch->elseExpr());
+    }
+    case EXPR_FOR:
+    {
+        auto *loop = cast<ForExprAST>(expr);
+        return 1 + countNodes(loop->start()) + countNodes(loop->end()) +
+               countNodes(loop->step()) + countNodes(loop->body());
+    }
+    case EXPR_VAR:
+    {
+        auto *var = cast<VarExprAST>(expr);
+        size_t count = 1 + countNodes(var->body());
+        for (const ExprAST *init : var->inits())
+        {
+            count += countNodes(init);
+        }
+        return count;
+    }
+    }
+    return 0;
+}
+
+// 解析出的全部顶层item
+struct ParsedSource
+{
+    vector<unique_ptr<PrototypeAST>> externs;
+    vector<unique_ptr<FunctionAST>> functions;
+};
+
+ParsedSource parseAll(const string &source)
+{
+    ParsedSource parsed;
+    StringCharStream stream(source);
+    Parser parser(&stream);
+    parser.GetNextToken();
+    // 与kal相同, 由ParseItem划分顶层item, 出错的item已经报错并跳过
+    while (true)
+    {
+        TopLevelItem item = parser.ParseItem();
+        if (item.kind == TopLevelItem::ITEM_EOF)
+        {
+            break;
+        }
+        switch (item.kind)
+        {
+        case TopLevelItem::ITEM_DEFINITION:
+        case TopLevelItem::ITEM_EXPRESSION:
+            parsed.functions.push_back(move(item.func));
+            break;
+        case TopLevelItem::ITEM_EXTERN:
+            parsed.externs.push_back(move(item.proto));
+            break;
+        default:
+            break;
+        }
+    }
+    return parsed;
+}
+
+void benchLex(const Workload &workload)
+{
+    uint64_t tokens = 0;
+    double seconds = bestOf([&]()
+                            {
+                                StringCharStream stream(workload.source);
+                                Parser parser(&stream);
+                                tokens = 0;
+                                while (parser.GetNextToken() != TOKEN_EOF)
+                                {
+                                    tokens++;
+                                } });
+    report("lex", workload.name, tokens, "tokens", seconds);
+}
+
+void benchParse(const Workload &workload)
+{
+    uint64_t nodes = 0;
+    double seconds = bestOf([&]()
+                            {
+                                ParsedSource parsed = parseAll(workload.source);
+                                nodes = 0;
+                                for (auto &func : parsed.functions)
+                                {
+                                    nodes += countNodes(func->body());
+                                } });
+    report("parse", workload.name, nodes, "nodes", seconds);
+}
+
+void benchCodeGen(const Workload &workload)
+{
+    uint64_t instructions = 0;
+    double best = 1e100;
+    for (unsigned i = 0; i < max(1u, (unsigned)g_repeat); i++)
+    {
+        // 只统计IR生成(以及--bench-O指定的优化)的耗时
+        ParsedSource parsed = parseAll(workload.source);
+        ASTContext context(DataLayout(""), g_bench_opt_level);
+        instructions = 0;
+        auto start = chrono::steady_clock::now();
+        for (auto &proto : parsed.externs)
+        {
+            proto->CodeGen(context);
+            context.functionProtos->add(*proto);
+        }
+        for (auto &func : parsed.functions)
+        {
+            if (Function *ir = func->CodeGen(context))
+            {
+                instructions += ir->getInstructionCount();
+                // 匿名函数重名，生成后立即删除
+                if (ir->getName() == g_anon_expr_name)
+                {
+                    ir->eraseFromParent();
+                }
+            }
+        }
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    report("codegen", workload.name, instructions, "insts", best);
+}
+
+// JIT执行顶层表达式的端到端延迟，以及直接调用JIT函数的延迟
+void benchJITCalls()
+{
+    auto jit = cantFail(KaleidoscopeJIT::Create());
+    ASTContext context(jit->dataLayout(), 2);
+    ParsedSource definitions = parseAll("def add(a b) a + b\n");
+    definitions.functions[0]->CodeGen(context);
+    cantFail(jit->addModule(context.takeModule()));
+
+    unsigned exprs = max(1u, (unsigned)g_size / 20);
+    double sum = 0;
+    auto start = chrono::steady_clock::now();
+    for (unsigned i = 0; i < exprs; i++)
+    {
+        ParsedSource parsed = parseAll("add(" + to_string(i) + ", 1)");
+        parsed.functions[0]->CodeGen(context);
+        sum += cantFail(jit->evaluate(context.takeModule(), g_anon_expr_name));
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    outs() << format("jit-expr   add          %10u exprs    %10.3f ms %10.3f us/expr\n",
+                     exprs, seconds * 1e3, seconds / exprs * 1e6);
+
+    auto symbol = cantFail(jit->lookup("add"));
+    auto *add = jitTargetAddressToFunction<double (*)(double, double)>(symbol.getAddress());
+    unsigned calls = max(1u, (unsigned)g_calls);
+    start = chrono::steady_clock::now();
+    for (unsigned i = 0; i < calls; i++)
+    {
+        sum = add(sum, 1);
+    }
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    outs() << format("jit-call   add          %10u calls    %10.3f ms %10.3f ns/call\n",
+                     calls, seconds * 1e3, seconds / calls * 1e9);
+    // 防止调用被优化掉
+    if (sum < 0)
+    {
+        outs() << sum << '\n';
+    }
+}
+
+// 递归调用的延迟: 与kal中的函数定义一样经由addDefinition交给JIT, fib(n)共调用2 * fib(n + 1) - 1次
+void benchFib()
+{
+    auto jit = cantFail(KaleidoscopeJIT::Create());
+    ASTContext context(jit->dataLayout(), 2);
+    ParsedSource definitions = parseAll("def fib(n) if n < 2 then n else fib(n - 1) + fib(n - 2)\n");
+    definitions.functions[0]->CodeGen(context);
+    cantFail(jit->addDefinition("fib", context.takeModule(), /*compileNow=*/true));
+    auto symbol = cantFail(jit->lookup("fib"));
+    auto *fib = jitTargetAddressToFunction<double (*)(double)>(symbol.getAddress());
+
+    uint64_t a = 0, b = 1;
+    for (unsigned i = 0; i <= g_fib; i++)
+    {
+        uint64_t next = a + b;
+        a = b;
+        b = next;
+    }
+    uint64_t calls = 2 * a - 1;
+    double result = 0;
+    double seconds = bestOf([&]()
+                            { result = fib(g_fib); });
+    outs() << format("jit-fib    fib(%-2u)      %10llu calls    %10.3f ms %10.3f ns/call\n",
+                     (unsigned)g_fib, (unsigned long long)calls, seconds * 1e3, seconds / calls * 1e9);
+    if (result < 0)
+    {
+        outs() << result << '\n';
+    }
+}
+
+// 与jit-call相同的函数, 经由Engine::batch()一次调用计算所有行
+void benchBatch()
+{
+    auto engine = cantFail(Engine::Create(2));
+    cantFail(engine->compile("def add(a b) a + b\n"));
+    auto add = cantFail(engine->batch<double(double, double)>("add"));
+    unsigned rows = max(1u, (unsigned)g_calls);
+    vector<double> lhs(rows), rhs(rows, 1), out(rows);
+    for (unsigned i = 0; i < rows; i++)
+    {
+        lhs[i] = i;
+    }
+    const void *columns[] = {lhs.data(), rhs.data()};
+    double seconds = bestOf([&]()
+                            { add(columns, out.data(), rows); });
+    outs() << format("jit-batch  add          %10u rows     %10.3f ms %10.3f ns/row\n",
+                     rows, seconds * 1e3, seconds / rows * 1e9);
+}
+
+int main(int argc, char const *argv[])
+{
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+
+    cl::HideUnrelatedOptions(g_bench_category);
+    cl::ParseCommandLineOptions(argc, argv, "kaleidoscope benchmarks\n");
+
+    vector<Workload> workloads = {
+        {"deep-expr", generateDeepExprs(g_size)},
+        {"many-defs", generateManyDefs(g_size)},
+        {"externs", generateExterns(g_size)},
+        {"calls", generateCalls(g_size)},
+    };
+    for (auto &workload : workloads)
+    {
+        benchLex(workload);
+    }
+    for (auto &workload : workloads)
+    {
+        benchParse(workload);
+    }
+    for (auto &workload : workloads)
+    {
+        benchCodeGen(workload);
+    }
+    benchJITCalls();
+    benchFib();
+    benchBatch();
+    return 0;
+}
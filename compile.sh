@@ -1,5 +1,5 @@
 #!/bin/sh
 
-g++ -std=c++11 main.cpp -o kal
-
-
+LLVM_FLAGS="$(llvm-config --cxxflags --ldflags --libs bitwriter core orcjit native perfjitevents)"
+g++ -std=c++14 -O2 main.cpp kaleidoscope.cpp interp.cpp $LLVM_FLAGS -o kal
+g++ -std=c++14 -O2 bench.cpp kaleidoscope.cpp engine.cpp $LLVM_FLAGS -o kal_bench
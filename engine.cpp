@@ -0,0 +1,280 @@
+#include "engine.h"
+
+Engine::Engine(unique_ptr<KaleidoscopeJIT> jit, unique_ptr<TargetMachine> targetMachine, unsigned optLevel)
+    : jit_(move(jit)), targetMachine_(move(targetMachine)),
+      context_(make_unique<ASTContext>(jit_->dataLayout(), optLevel, make_shared<PrototypeTable>(),
+                                       targetMachine_.get()))
+{
+}
+
+Expected<unique_ptr<Engine>> Engine::Create(unsigned optLevel)
+{
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+    // 函数定义在第一次被调用时编译, 可能同时发生在宿主的多个线程中, 需要线程安全的编译器
+    auto jit = KaleidoscopeJIT::Create(1);
+    if (!jit)
+    {
+        return jit.takeError();
+    }
+    auto targetMachine = (*jit)->createTargetMachine();
+    if (!targetMachine)
+    {
+        return targetMachine.takeError();
+    }
+    return make_unique<Engine>(move(*jit), move(*targetMachine), min(optLevel, 3u));
+}
+
+Error Engine::compile(StringRef source)
+{
+    ErrorCapture errors;
+    StringCharStream stream(source.str());
+    Parser parser(&stream);
+    parser.GetNextToken();
+    // 与kal相同, 由ParseItem划分顶层item(包括跳过分隔用的';'), 出错的item已经报错并跳过
+    while (true)
+    {
+        TopLevelItem item = parser.ParseItem();
+        if (item.kind == TopLevelItem::ITEM_EOF)
+        {
+            break;
+        }
+        switch (item.kind)
+        {
+        case TopLevelItem::ITEM_DEFINITION:
+        {
+            // 与kal相同, 每个定义一个module, 经由桩调用, 可以重新定义
+            auto ast = move(item.func);
+            if (ast->CodeGen(*context_) == nullptr)
+            {
+                break;
+            }
+            StringRef name = g_symbols.name(ast->name());
+            if (Error err = jit_->addDefinition(name, context_->takeModule()))
+            {
+                return joinErrors(errors.takeError(), move(err));
+            }
+            // 交给JIT之后才记录, 旧的批量求值入口内联了旧的函数体, 不再使用
+            batches_.erase(name);
+            definitions_[ast->name()] = move(ast);
+            break;
+        }
+        case TopLevelItem::ITEM_EXTERN:
+        {
+            auto ast = move(item.proto);
+            ast->CodeGen(*context_);
+            context_->functionProtos->addExtern(*ast);
+            break;
+        }
+        case TopLevelItem::ITEM_EXPRESSION:
+        {
+            auto ast = move(item.func);
+            if (ast->CodeGen(*context_))
+            {
+                auto result = jit_->evaluate(context_->takeModule(), g_anon_expr_name);
+                if (!result)
+                {
+                    return joinErrors(errors.takeError(), result.takeError());
+                }
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    return errors.takeError();
+}
+
+Error Engine::addHostFunction(Symbol name, vector<ValueType> argTypes, ValueType returnType,
+                              JITTargetAddress address)
+{
+    vector<Symbol> args;
+    for (size_t i = 0; i < argTypes.size(); i++)
+    {
+        args.push_back(g_symbols.intern("arg" + to_string(i)));
+    }
+    context_->functionProtos->add(PrototypeAST(name, move(args), move(argTypes), returnType));
+    return jit_->addHostSymbol(g_symbols.name(name), address);
+}
+
+Expected<JITTargetAddress> Engine::lookup(StringRef name, const vector<ValueType> &argTypes,
+                                          ValueType returnType)
+{
+    auto proto = context_->functionProtos->find(g_symbols.intern(name));
+    if (!proto)
+    {
+        return make_error<StringError>("unknown function " + name, inconvertibleErrorCode());
+    }
+    if (proto->argTypes() != argTypes || proto->returnType() != returnType)
+    {
+        return make_error<StringError>("function " + name + " has a different signature",
+                                       inconvertibleErrorCode());
+    }
+    // 函数定义得到的是桩的地址; 先编译函数体, 第一次调用不必等待JIT
+    if (Error err = jit_->compileDefinition(name))
+    {
+        return err;
+    }
+    auto symbol = jit_->lookup(name);
+    if (!symbol)
+    {
+        return symbol.takeError();
+    }
+    return symbol->getAddress();
+}
+
+Expected<BatchFunction> Engine::buildBatch(StringRef name, const vector<ValueType> &argTypes,
+                                           ValueType returnType)
+{
+    auto address = lookup(name, argTypes, returnType);
+    if (!address)
+    {
+        return address.takeError();
+    }
+    auto cached = batches_.find(name);
+    if (cached != batches_.end())
+    {
+        return BatchFunction(cached->second);
+    }
+    if (is_contained(argTypes, TYPE_ARRAY) || returnType == TYPE_ARRAY)
+    {
+        return make_error<StringError>("function " + name + " takes or returns an array and cannot be batched",
+                                       inconvertibleErrorCode());
+    }
+    ErrorCapture errors;
+    ASTContext &context = *context_;
+    Symbol symbol = g_symbols.intern(name);
+    Function *callee = nullptr;
+    auto definition = definitions_.find(symbol);
+    if (definition != definitions_.end())
+    {
+        // 在新的module中重新生成函数体作为内部函数, 内联后删除; JIT中原来的定义不变
+        callee = definition->second->CodeGen(context);
+        if (callee != nullptr)
+        {
+            callee->setName(name + ".inline");
+            callee->setLinkage(GlobalValue::InternalLinkage);
+        }
+    }
+    else
+    {
+        callee = context.getFunction(symbol);
+    }
+    if (callee == nullptr)
+    {
+        return errors.takeError();
+    }
+
+    // void __kal_batch_<name>(i8** columns, i8* out, i64 begin, i64 end)
+    LLVMContext &llvmContext = context.llvmContext;
+    IRBuilder<> &builder = context.irBuilder;
+    Type *bytePtr = Type::getInt8PtrTy(llvmContext);
+    Type *i64 = Type::getInt64Ty(llvmContext);
+    FunctionType *type = FunctionType::get(Type::getVoidTy(llvmContext),
+                                           {bytePtr->getPointerTo(), bytePtr, i64, i64}, false);
+    // 重新定义后生成的入口不能与旧的入口同名, 旧的入口仍然有效
+    string entryName = ("__kal_batch_" + name + "." + Twine(batchCount_++)).str();
+    Function *batch = Function::Create(type, Function::ExternalLinkage, entryName, context.module.get());
+    Value *columns = batch->getArg(0);
+    Value *out = batch->getArg(1);
+    Value *begin = batch->getArg(2);
+    Value *end = batch->getArg(3);
+    // 列中元素的类型, bool与C++一样占一个字节
+    auto storageType = [&](ValueType type)
+    {
+        return type == TYPE_BOOL ? Type::getInt8Ty(llvmContext) : context.llvmType(type);
+    };
+
+    BasicBlock *entry = BasicBlock::Create(llvmContext, "entry", batch);
+    BasicBlock *loop = BasicBlock::Create(llvmContext, "row", batch);
+    BasicBlock *exit = BasicBlock::Create(llvmContext, "exit", batch);
+    builder.SetInsertPoint(entry);
+    SmallVector<Value *, 8> columnPtrs;
+    for (size_t i = 0; i < argTypes.size(); i++)
+    {
+        Value *column = builder.CreateLoad(bytePtr, builder.CreateConstInBoundsGEP1_64(bytePtr, columns, i));
+        columnPtrs.push_back(builder.CreatePointerCast(column, storageType(argTypes[i])->getPointerTo()));
+    }
+    Value *outPtr = builder.CreatePointerCast(out, storageType(returnType)->getPointerTo());
+    builder.CreateCondBr(builder.CreateICmpSLT(begin, end), loop, exit);
+
+    builder.SetInsertPoint(loop);
+    PHINode *row = builder.CreatePHI(i64, 2, "i");
+    row->addIncoming(begin, entry);
+    SmallVector<Value *, 8> args;
+    for (size_t i = 0; i < argTypes.size(); i++)
+    {
+        Type *element = storageType(argTypes[i]);
+        Value *arg = builder.CreateLoad(element, builder.CreateInBoundsGEP(element, columnPtrs[i], row));
+        if (argTypes[i] == TYPE_BOOL)
+        {
+            arg = builder.CreateICmpNE(arg, ConstantInt::get(element, 0));
+        }
+        args.push_back(arg);
+    }
+    CallInst *call = builder.CreateCall(callee, args);
+    Value *result = call;
+    if (returnType == TYPE_BOOL)
+    {
+        result = builder.CreateZExt(result, storageType(returnType));
+    }
+    builder.CreateStore(result, builder.CreateInBoundsGEP(storageType(returnType), outPtr, row));
+    Value *next = builder.CreateNSWAdd(row, ConstantInt::get(i64, 1), "next");
+    row->addIncoming(next, loop);
+    builder.CreateCondBr(builder.CreateICmpSLT(next, end), loop, exit);
+
+    builder.SetInsertPoint(exit);
+    builder.CreateRetVoid();
+
+    if (callee->hasInternalLinkage())
+    {
+        InlineFunctionInfo info;
+        InlineFunction(*call, info);
+        // 递归函数内联一层后仍然调用自己
+        if (callee->use_empty())
+        {
+            callee->eraseFromParent();
+        }
+    }
+    verifyFunction(*batch);
+    context.passManager->run(*batch);
+    if (Error err = jit_->addModule(context.takeModule()))
+    {
+        return joinErrors(errors.takeError(), move(err));
+    }
+    auto entrySymbol = jit_->lookup(entryName);
+    if (!entrySymbol)
+    {
+        return joinErrors(errors.takeError(), entrySymbol.takeError());
+    }
+    auto entryPoint = jitTargetAddressToFunction<BatchFunction::Entry>(entrySymbol->getAddress());
+    batches_[name] = entryPoint;
+    return BatchFunction(entryPoint);
+}
+
+void BatchFunction::operator()(const void *const *columns, void *out, size_t rows, unsigned threads) const
+{
+    size_t chunks = min<size_t>(max(threads, 1u), max<size_t>(rows / kMinRowsPerThread, 1));
+    vector<std::thread> workers;
+    size_t begin = 0;
+    for (size_t i = 1; i <= chunks; i++)
+    {
+        size_t end = rows * i / chunks;
+        if (i == chunks)
+        {
+            // 最后一段在当前线程中计算
+            entry_(columns, out, begin, end);
+        }
+        else
+        {
+            workers.emplace_back(entry_, columns, out, (int64_t)begin, (int64_t)end);
+        }
+        begin = end;
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "kaleidoscope.h"
+
+// 嵌入宿主程序的kaleidoscope引擎: 编译一次源码, 之后通过函数指针反复调用,
+// 调用时不再经过解析器和JIT。
+//
+//   auto engine = cantFail(Engine::Create());
+//   cantFail(engine->addFunction("clamp", &clamp)); // double clamp(double)
+//   cantFail(engine->compile("def scale(x k) clamp(x * k)"));
+//   auto scale = cantFail(engine->get<double(double, double)>("scale"));
+//   double y = scale(0.5, 3);
+//   auto scaleAll = cantFail(engine->batch<double(double, double)>("scale"));
+//   const void *columns[] = {xs, ks};
+//   scaleAll(columns, ys, rows); // ys[i] = scale(xs[i], ks[i])
+//
+// Engine本身不是线程安全的; 得到的函数指针在Engine析构前有效, 可以在任意线程中调用
+
+// C++类型对应的kaleidoscope类型
+template <typename T>
+struct KalTypeOf;
+template <>
+struct KalTypeOf<double>
+{
+    static const ValueType value = TYPE_DOUBLE;
+};
+template <>
+struct KalTypeOf<int64_t>
+{
+    static const ValueType value = TYPE_INT;
+};
+template <>
+struct KalTypeOf<bool>
+{
+    static const ValueType value = TYPE_BOOL;
+};
+template <>
+struct KalTypeOf<KalArray *>
+{
+    static const ValueType value = TYPE_ARRAY;
+};
+
+// 函数签名, 比如double(double, int64_t)
+template <typename Signature>
+struct KalSignature;
+template <typename R, typename... Args>
+struct KalSignature<R(Args...)>
+{
+    typedef R (*Pointer)(Args...);
+
+    static vector<ValueType> argTypes() { return {KalTypeOf<Args>::value...}; }
+    static ValueType returnType() { return KalTypeOf<R>::value; }
+};
+
+// 对按列存放(struct-of-arrays)的输入批量求值的函数, 由Engine::batch()生成。
+// 每批输入只有一次宿主到JIT代码的调用, 逐行的循环在JIT代码中
+class BatchFunction
+{
+public:
+    // 对[begin, end)中的每一行i计算 out[i] = f(columns[0][i], columns[1][i], ...)
+    typedef void (*Entry)(const void *const *columns, void *out, int64_t begin, int64_t end);
+
+private:
+    // 每个线程至少处理的行数, 行数太少时不值得创建线程
+    static const size_t kMinRowsPerThread = 16384;
+
+    Entry entry_;
+
+public:
+    explicit BatchFunction(Entry entry) : entry_(entry) {}
+
+    // columns[j]指向第j个参数的rows个值, out指向rows个结果, 元素类型与函数接口一致
+    // (double、int64_t或bool)。threads大于1时把行分成几段在多个线程中并发计算
+    void operator()(const void *const *columns, void *out, size_t rows, unsigned threads = 1) const;
+};
+
+class Engine
+{
+private:
+    unique_ptr<KaleidoscopeJIT> jit_;
+    unique_ptr<TargetMachine> targetMachine_;
+    unique_ptr<ASTContext> context_;
+    // 已经交给JIT的compile()定义的函数, batch()据此重新生成函数体内联进循环
+    DenseMap<Symbol, unique_ptr<FunctionAST>> definitions_;
+    // 已经生成的批量求值入口, 函数被重新定义时删除
+    StringMap<BatchFunction::Entry> batches_;
+    // 生成过的批量求值入口个数, 用于入口的符号名
+    unsigned batchCount_ = 0;
+
+    Error addHostFunction(Symbol name, vector<ValueType> argTypes, ValueType returnType,
+                          JITTargetAddress address);
+    // 查找已编译的函数, 接口与argTypes/returnType不一致时报错
+    Expected<JITTargetAddress> lookup(StringRef name, const vector<ValueType> &argTypes,
+                                      ValueType returnType);
+    Expected<BatchFunction> buildBatch(StringRef name, const vector<ValueType> &argTypes,
+                                       ValueType returnType);
+
+public:
+    Engine(unique_ptr<KaleidoscopeJIT> jit, unique_ptr<TargetMachine> targetMachine, unsigned optLevel);
+
+    static Expected<unique_ptr<Engine>> Create(unsigned optLevel = 2);
+
+    // 编译source中的函数定义和extern声明, 顶层表达式按顺序执行, 结果被丢弃。
+    // 出错的item被跳过, 其余的照常编译, 所有错误合并后返回。
+    // 函数定义可以在之后的compile()中以相同的接口重新定义, 之前get()得到的指针调用新的定义
+    Error compile(StringRef source);
+
+    // 把宿主函数注册为name, 不需要在源码中用extern声明。
+    // JIT代码直接调用func的地址, 没有额外的间接跳转
+    template <typename R, typename... Args>
+    Error addFunction(StringRef name, R (*func)(Args...))
+    {
+        return addHostFunction(g_symbols.intern(name), KalSignature<R(Args...)>::argTypes(),
+                               KalSignature<R(Args...)>::returnType(), pointerToJITTargetAddress(func));
+    }
+
+    // 取得已编译函数的指针, Signature必须与函数的接口一致, 比如double(double, double)
+    template <typename Signature>
+    Expected<typename KalSignature<Signature>::Pointer> get(StringRef name)
+    {
+        auto address = lookup(name, KalSignature<Signature>::argTypes(), KalSignature<Signature>::returnType());
+        if (!address)
+        {
+            return address.takeError();
+        }
+        return jitTargetAddressToFunction<typename KalSignature<Signature>::Pointer>(*address);
+    }
+
+    // 生成对函数name批量求值的BatchFunction, Signature与get()相同, 参数不能是array。
+    // compile()定义的函数内联进逐行的循环(可以被向量化), addFunction()注册的宿主函数在循环中调用
+    template <typename Signature>
+    Expected<BatchFunction> batch(StringRef name)
+    {
+        return buildBatch(name, KalSignature<Signature>::argTypes(), KalSignature<Signature>::returnType());
+    }
+};
@@ -0,0 +1,772 @@
+#include "interp.h"
+
+typedef Interpreter::Cell InterpCell;
+typedef Interpreter::Node Node;
+typedef Interpreter::NodeId NodeId;
+
+// 翻译结果: 节点和它的类型。constant表示生成IR时这个值是常量(常量折叠的结果),
+// 此时value是它的值。节点仍然要求值, 比如 (for ...) + i 中的for循环
+struct InterpExpr
+{
+    NodeId node;
+    ValueType type;
+    bool constant;
+    InterpCell value;
+};
+
+// 把一个函数的AST翻译为Interpreter::FunctionCode, 类型规则与IR生成完全一致
+class InterpTranslator
+{
+private:
+    struct Variable
+    {
+        uint32_t slot;
+        ValueType type;
+    };
+
+    Interpreter &interp;
+    Interpreter::FunctionCode &code;
+    DenseMap<Symbol, Variable> scope;
+
+public:
+    Interpreter::Status status = Interpreter::INTERP_OK;
+
+    InterpTranslator(Interpreter &interp, Interpreter::FunctionCode &code) : interp(interp), code(code) {}
+
+    bool fail(const char *message)
+    {
+        LogError(message);
+        status = Interpreter::INTERP_FAILED;
+        return false;
+    }
+    bool unsupported()
+    {
+        status = Interpreter::INTERP_UNSUPPORTED;
+        return false;
+    }
+
+    NodeId add(const Node &node)
+    {
+        code.nodes.push_back(node);
+        return code.nodes.size() - 1;
+    }
+    Node node(Interpreter::Op op)
+    {
+        Node node;
+        memset(&node, 0, sizeof(node));
+        node.op = op;
+        return node;
+    }
+    uint32_t addChildren(ArrayRef<NodeId> children)
+    {
+        uint32_t first = code.children.size();
+        code.children.insert(code.children.end(), children.begin(), children.end());
+        return first;
+    }
+
+    InterpExpr constant(ValueType type, InterpCell value)
+    {
+        Node n = node(Interpreter::OP_CONST);
+        n.constant = value;
+        return {add(n), type, true, value};
+    }
+
+    // 与convertValue相同的转换, 常量在翻译时直接折叠
+    InterpExpr convert(InterpExpr expr, ValueType type)
+    {
+        if (expr.type == type)
+        {
+            return expr;
+        }
+        Interpreter::Conversion conversion;
+        InterpCell value = expr.value;
+        if (type == TYPE_BOOL)
+        {
+            conversion = expr.type == TYPE_DOUBLE ? Interpreter::CONV_DOUBLE_TO_BOOL : Interpreter::CONV_INT_TO_BOOL;
+            value.i = expr.type == TYPE_DOUBLE ? (expr.value.d < 0 || expr.value.d > 0) : expr.value.i != 0;
+        }
+        else if (type == TYPE_DOUBLE)
+        {
+            conversion = expr.type == TYPE_BOOL ? Interpreter::CONV_BOOL_TO_DOUBLE : Interpreter::CONV_INT_TO_DOUBLE;
+            value.d = (double)expr.value.i;
+        }
+        else if (expr.type == TYPE_DOUBLE)
+        {
+            conversion = Interpreter::CONV_DOUBLE_TO_INT;
+            value.i = expr.constant ? (int64_t)expr.value.d : 0;
+        }
+        else
+        {
+            // bool到int是zext, 值不变
+            return {expr.node, type, expr.constant, expr.value};
+        }
+        if (expr.constant && code.nodes[expr.node].op == Interpreter::OP_CONST)
+        {
+            return constant(type, value);
+        }
+        Node n = node(Interpreter::OP_CONVERT);
+        n.conversion = conversion;
+        n.binary.lhs = expr.node;
+        return {add(n), type, expr.constant, value};
+    }
+
+    // 见emitBinaryOp中的integralConstant
+    InterpExpr integralConstant(InterpExpr expr)
+    {
+        if (expr.constant && expr.type == TYPE_DOUBLE && expr.value.d == trunc(expr.value.d) &&
+            expr.value.d >= -0x1p63 && expr.value.d < 0x1p63)
+        {
+            return convert(expr, TYPE_INT);
+        }
+        return expr;
+    }
+
+    // 绑定新变量, 返回被覆盖的绑定
+    Optional<Variable> bind(Symbol name, ValueType type, uint32_t &slot)
+    {
+        slot = code.slots++;
+        Optional<Variable> old;
+        auto it = scope.find(name);
+        if (it != scope.end())
+        {
+            old = it->second;
+        }
+        scope[name] = {slot, type};
+        return old;
+    }
+    void restore(Symbol name, const Optional<Variable> &old)
+    {
+        if (old)
+        {
+            scope[name] = *old;
+        }
+        else
+        {
+            scope.erase(name);
+        }
+    }
+
+    bool binary(char op, const InterpExpr &lhs_expr, const InterpExpr &rhs_expr, InterpExpr &out)
+    {
+        if (op == ':')
+        {
+            Node n = node(Interpreter::OP_SEQ);
+            n.binary.lhs = lhs_expr.node;
+            n.binary.rhs = rhs_expr.node;
+            out = {add(n), rhs_expr.type, rhs_expr.constant, rhs_expr.value};
+            return true;
+        }
+        InterpExpr lhs = lhs_expr, rhs = rhs_expr;
+        if (lhs.type != TYPE_DOUBLE || rhs.type != TYPE_DOUBLE)
+        {
+            lhs = integralConstant(lhs);
+            rhs = integralConstant(rhs);
+        }
+        bool is_double = lhs.type == TYPE_DOUBLE || rhs.type == TYPE_DOUBLE;
+        lhs = convert(lhs, is_double ? TYPE_DOUBLE : TYPE_INT);
+        rhs = convert(rhs, is_double ? TYPE_DOUBLE : TYPE_INT);
+        Interpreter::Op code_op;
+        InterpCell value;
+        ValueType type = is_double ? TYPE_DOUBLE : TYPE_INT;
+        double l = lhs.value.d, r = rhs.value.d;
+        uint64_t li = lhs.value.i, ri = rhs.value.i;
+        switch (op)
+        {
+        case '<':
+            code_op = is_double ? Interpreter::OP_FLT : Interpreter::OP_ILT;
+            value.i = is_double ? !(l >= r) : (int64_t)li < (int64_t)ri;
+            type = TYPE_BOOL;
+            break;
+        case '+':
+            code_op = is_double ? Interpreter::OP_FADD : Interpreter::OP_IADD;
+            is_double ? (void)(value.d = l + r) : (void)(value.i = li + ri);
+            break;
+        case '-':
+            code_op = is_double ? Interpreter::OP_FSUB : Interpreter::OP_ISUB;
+            is_double ? (void)(value.d = l - r) : (void)(value.i = li - ri);
+            break;
+        case '*':
+            code_op = is_double ? Interpreter::OP_FMUL : Interpreter::OP_IMUL;
+            is_double ? (void)(value.d = l * r) : (void)(value.i = li * ri);
+            break;
+        default:
+            return fail("invalid binary operator");
+        }
+        bool constant = lhs.constant && rhs.constant;
+        if (constant && code.nodes[lhs.node].op == Interpreter::OP_CONST &&
+            code.nodes[rhs.node].op == Interpreter::OP_CONST)
+        {
+            out = this->constant(type, value);
+            return true;
+        }
+        Node n = node(code_op);
+        n.binary.lhs = lhs.node;
+        n.binary.rhs = rhs.node;
+        out = {add(n), type, constant, value};
+        return true;
+    }
+
+    bool call(Symbol callee, ArrayRef<ExprAST *> args, InterpExpr &out)
+    {
+        if (g_symbols.isBuiltin(callee))
+        {
+            return unsupported();
+        }
+        auto proto = interp.functionProtos_->find(callee);
+        if (!proto)
+        {
+            return fail("unknown function referenced");
+        }
+        if (proto->args().size() != args.size())
+        {
+            return fail("incorrect # arguments passed");
+        }
+        if (proto->returnType() == TYPE_ARRAY)
+        {
+            return unsupported();
+        }
+        SmallVector<NodeId, 8> arg_nodes;
+        for (size_t i = 0; i < args.size(); i++)
+        {
+            if (proto->argTypes()[i] == TYPE_ARRAY)
+            {
+                return unsupported();
+            }
+            InterpExpr arg;
+            if (!translate(args[i], arg))
+            {
+                return false;
+            }
+            arg_nodes.push_back(convert(arg, proto->argTypes()[i]).node);
+        }
+        Node n = node(Interpreter::OP_CALL);
+        n.slot = code.callees.size();
+        code.callees.push_back(interp.function(callee, *proto));
+        n.list.first = addChildren(arg_nodes);
+        n.list.count = arg_nodes.size();
+        out = {add(n), proto->returnType(), false, {}};
+        return true;
+    }
+
+    bool translate(const ExprAST *expr, InterpExpr &out)
+    {
+        switch (expr->kind())
+        {
+        case EXPR_NUMBER:
+        {
+            InterpCell value;
+            value.d = cast<NumberExprAST>(expr)->val();
+            out = constant(TYPE_DOUBLE, value);
+            return true;
+        }
+        case EXPR_VARIABLE:
+        {
+            auto it = scope.find(cast<VariableExprAST>(expr)->name());
+            if (it == scope.end())
+            {
+                return fail("unknown variable name");
+            }
+            Node n = node(Interpreter::OP_LOAD);
+            n.slot = it->second.slot;
+            out = {add(n), it->second.type, false, {}};
+            return true;
+        }
+        case EXPR_BINARY:
+        {
+            auto *binary = cast<BinaryExprAST>(expr);
+            if (binary->op() == '=')
+            {
+                auto *var = dyn_cast<VariableExprAST>(binary->lhs());
+                if (var == nullptr)
+                {
+                    return fail("destination of '=' must be a variable");
+                }
+                InterpExpr value;
+                if (!translate(binary->rhs(), value))
+                {
+                    return false;
+                }
+                auto it = scope.find(var->name());
+                if (it == scope.end())
+                {
+                    return fail("unknown variable name");
+                }
+                value = convert(value, it->second.type);
+                Node n = node(Interpreter::OP_STORE);
+                n.slot = it->second.slot;
+                n.binary.lhs = value.node;
+                out = {add(n), value.type, value.constant, value.value};
+                return true;
+            }
+            InterpExpr lhs, rhs;
+            if (!translate(binary->lhs(), lhs) || !translate(binary->rhs(), rhs))
+            {
+                return false;
+            }
+            return this->binary(binary->op(), lhs, rhs, out);
+        }
+        case EXPR_CALL:
+        {
+            auto *call = cast<CallExprAST>(expr);
+            return this->call(call->callee(), call->args(), out);
+        }
+        case EXPR_IF:
+        {
+            auto *branch = cast<IfExprAST>(expr);
+            InterpExpr cond, then, otherwise;
+            if (!translate(branch->cond(), cond))
+            {
+                return false;
+            }
+            cond = convert(cond, TYPE_BOOL);
+            if (!translate(branch->thenExpr(), then) || !translate(branch->elseExpr(), otherwise))
+            {
+                return false;
+            }
+            // 两个分支的类型不同时合并为double(有一边是double)或int, 见emitIfExpr
+            ValueType type = then.type;
+            if (otherwise.type != type)
+            {
+                type = then.type == TYPE_DOUBLE || otherwise.type == TYPE_DOUBLE ? TYPE_DOUBLE : TYPE_INT;
+            }
+            NodeId children[] = {cond.node, convert(then, type).node, convert(otherwise, type).node};
+            Node n = node(Interpreter::OP_IF);
+            n.list.first = addChildren(children);
+            n.list.count = 3;
+            out = {add(n), type, false, {}};
+            return true;
+        }
+        case EXPR_FOR:
+        {
+            auto *loop = cast<ForExprAST>(expr);
+            if (loop->type() == TYPE_ARRAY)
+            {
+                return unsupported();
+            }
+            InterpExpr start;
+            if (!translate(loop->start(), start))
+            {
+                return false;
+            }
+            // 见emitForExpr
+            ValueType type = loop->type();
+            if (type == TYPE_AUTO)
+            {
+                type = start.type == TYPE_BOOL ? TYPE_INT : start.type;
+            }
+            start = convert(start, type);
+            uint32_t slot;
+            auto old = bind(loop->var(), type, slot);
+            InterpExpr end, step, body;
+            bool ok = translate(loop->end(), end) && translate(loop->body(), body) &&
+                      translate(loop->step(), step);
+            restore(loop->var(), old);
+            if (!ok)
+            {
+                return false;
+            }
+            NodeId children[] = {start.node, convert(end, TYPE_BOOL).node, convert(step, type).node, body.node};
+            Node n = node(Interpreter::OP_FOR);
+            n.slot = slot;
+            n.intLoop = type != TYPE_DOUBLE;
+            n.list.first = addChildren(children);
+            n.list.count = 4;
+            // for循环的值是常量0.0
+            InterpCell zero;
+            zero.d = 0;
+            out = {add(n), TYPE_DOUBLE, true, zero};
+            return true;
+        }
+        case EXPR_VAR:
+        {
+            auto *var = cast<VarExprAST>(expr);
+            SmallVector<NodeId, 8> children;
+            SmallVector<pair<Symbol, Optional<Variable>>, 4> olds;
+            auto restore_all = [&]()
+            {
+                for (auto it = olds.rbegin(); it != olds.rend(); ++it)
+                {
+                    restore(it->first, it->second);
+                }
+            };
+            for (size_t i = 0; i < var->names().size(); i++)
+            {
+                if (var->types()[i] == TYPE_ARRAY)
+                {
+                    restore_all();
+                    return unsupported();
+                }
+                InterpExpr init;
+                if (!translate(var->inits()[i], init))
+                {
+                    restore_all();
+                    return false;
+                }
+                ValueType type = var->types()[i] == TYPE_AUTO ? init.type : var->types()[i];
+                init = convert(init, type);
+                Node n = node(Interpreter::OP_STORE);
+                olds.emplace_back(var->names()[i], bind(var->names()[i], type, n.slot));
+                n.binary.lhs = init.node;
+                children.push_back(add(n));
+            }
+            InterpExpr body;
+            bool ok = translate(var->body(), body);
+            restore_all();
+            if (!ok)
+            {
+                return false;
+            }
+            children.push_back(body.node);
+            Node n = node(Interpreter::OP_BLOCK);
+            n.list.first = addChildren(children);
+            n.list.count = children.size();
+            out = {add(n), body.type, body.constant, body.value};
+            return true;
+        }
+        }
+        return fail("unknown expression");
+    }
+
+    // 翻译函数体, 参数占用栈帧最前面的位置
+    bool function(const ExprAST *body)
+    {
+        const PrototypeAST &proto = code.proto;
+        if (proto.returnType() == TYPE_ARRAY)
+        {
+            return unsupported();
+        }
+        for (size_t i = 0; i < proto.args().size(); i++)
+        {
+            if (proto.argTypes()[i] == TYPE_ARRAY)
+            {
+                return unsupported();
+            }
+            uint32_t slot;
+            bind(proto.args()[i], proto.argTypes()[i], slot);
+        }
+        InterpExpr result;
+        if (!translate(body, result))
+        {
+            return false;
+        }
+        code.root = convert(result, proto.returnType()).node;
+        return true;
+    }
+};
+
+//
+
+Interpreter::Interpreter(KaleidoscopeJIT &jit, shared_ptr<PrototypeTable> functionProtos, unsigned threshold)
+    : jit_(jit), functionProtos_(move(functionProtos)), threshold_(threshold)
+{
+}
+
+Interpreter::FunctionCode *Interpreter::function(Symbol name, const PrototypeAST &proto)
+{
+    auto &func = functions_[name];
+    if (func == nullptr)
+    {
+        func = make_unique<FunctionCode>(proto);
+    }
+    return func.get();
+}
+
+Interpreter::Status Interpreter::addFunction(const FunctionAST &func)
+{
+    PhaseScope scope(PHASE_CODEGEN);
+    if (func.body() == nullptr)
+    {
+        return INTERP_UNSUPPORTED;
+    }
+    Symbol name = func.name();
+    // 与FunctionAST::CodeGen一样先记录函数接口, 函数体中可以递归调用自己。
+    // 重新定义时接口不变, 之前翻译的调用和JIT层的入口都仍然有效
+    if (!functionProtos_->define(func.proto()))
+    {
+        return INTERP_FAILED;
+    }
+    if (func.memoized())
+    {
+        // 缓存表在JIT代码中, 记忆化的函数不解释执行
+        auto it = functions_.find(name);
+        if (it != functions_.end())
+        {
+            it->second->interpreted = false;
+        }
+        return INTERP_UNSUPPORTED;
+    }
+    auto code = make_unique<FunctionCode>(func.proto());
+    InterpTranslator translator(*this, *code);
+    if (!translator.function(func.body()))
+    {
+        auto it = functions_.find(name);
+        if (translator.status == INTERP_UNSUPPORTED && it != functions_.end())
+        {
+            // 新的定义只能交给JIT, 之后经由入口函数调用
+            it->second->interpreted = false;
+        }
+        return translator.status;
+    }
+    FunctionCode *entry = function(name, func.proto());
+    if (entry->native)
+    {
+        // 之前当作extern调用过或者已经提升到JIT层, 入口经由桩调用最新的定义
+        return INTERP_OK;
+    }
+    // 其他函数(包括它自己)中的调用指向entry, 原地更新
+    entry->hotness = 0;
+    entry->nodes = move(code->nodes);
+    entry->children = move(code->children);
+    entry->callees = move(code->callees);
+    entry->root = code->root;
+    entry->slots = code->slots;
+    entry->interpreted = true;
+    return INTERP_OK;
+}
+
+Interpreter::Status Interpreter::run(const FunctionAST &expr, double &result)
+{
+    if (expr.body() == nullptr)
+    {
+        return INTERP_UNSUPPORTED;
+    }
+    FunctionCode code(expr.proto());
+    {
+        PhaseScope scope(PHASE_CODEGEN);
+        InterpTranslator translator(*this, code);
+        if (!translator.function(expr.body()))
+        {
+            return translator.status;
+        }
+    }
+    // 顶层表达式只执行一次, 不参与提升
+    PhaseScope scope(PHASE_EXECUTE);
+    failed_ = false;
+    SmallVector<Cell, 16> frame(code.slots);
+    result = eval(code, code.root, frame.data()).d;
+    return failed_ ? INTERP_FAILED : INTERP_OK;
+}
+
+Expected<Interpreter::NativeEntry> Interpreter::buildEntry(const PrototypeAST &proto)
+{
+    if (context_ == nullptr)
+    {
+        auto targetMachine = jit_.createTargetMachine();
+        if (!targetMachine)
+        {
+            return targetMachine.takeError();
+        }
+        targetMachine_ = move(*targetMachine);
+        context_ = make_unique<ASTContext>(jit_.dataLayout(), 1, functionProtos_, targetMachine_.get());
+    }
+    ASTContext &context = *context_;
+    IRBuilder<> &builder = context.irBuilder;
+    Function *callee = context.getFunction(proto.name());
+    string name = ("__kal_entry_" + g_symbols.name(proto.name())).str();
+    Type *slot_type = builder.getInt64Ty();
+    FunctionType *entry_type = FunctionType::get(
+        builder.getVoidTy(), {slot_type->getPointerTo(), slot_type->getPointerTo()}, false);
+    Function *entry = Function::Create(entry_type, Function::ExternalLinkage, name, context.module.get());
+    builder.SetInsertPoint(BasicBlock::Create(context.llvmContext, "entry", entry));
+    // 每个值占一个64位的槽, double按位存放, bool为0/1
+    SmallVector<Value *, 8> args;
+    for (unsigned i = 0; i < callee->arg_size(); i++)
+    {
+        Value *slot = builder.CreateLoad(slot_type, builder.CreateConstInBoundsGEP1_64(slot_type, entry->getArg(0), i));
+        Type *type = callee->getArg(i)->getType();
+        args.push_back(type->isDoubleTy() ? builder.CreateBitCast(slot, type) : builder.CreateTruncOrBitCast(slot, type));
+    }
+    Value *ret = builder.CreateCall(callee, args);
+    ret = ret->getType()->isDoubleTy() ? builder.CreateBitCast(ret, slot_type) : builder.CreateZExtOrBitCast(ret, slot_type);
+    builder.CreateStore(ret, entry->getArg(1));
+    builder.CreateRetVoid();
+    verifyFunction(*entry);
+    if (Error err = jit_.addModule(context.takeModule()))
+    {
+        return err;
+    }
+    auto symbol = jit_.lookup(name);
+    if (!symbol)
+    {
+        return symbol.takeError();
+    }
+    return jitTargetAddressToFunction<NativeEntry>(symbol->getAddress());
+}
+
+Interpreter::Cell Interpreter::call(FunctionCode &func, const Cell *args)
+{
+    if (func.native == nullptr && (!func.interpreted || func.hotness >= threshold_))
+    {
+        // 提升到JIT层, 或者第一次调用只在JIT层的函数
+        auto entry = buildEntry(func.proto);
+        if (entry)
+        {
+            func.native = *entry;
+        }
+        else if (func.interpreted)
+        {
+            // JIT层不可用, 继续解释执行并且不再尝试提升
+            logAllUnhandledErrors(entry.takeError(), errs(), "Error: ");
+            threshold_ = UINT_MAX;
+        }
+        else
+        {
+            logAllUnhandledErrors(entry.takeError(), errs(), "Error: ");
+            failed_ = true;
+            return Cell();
+        }
+    }
+    Cell ret;
+    if (func.native)
+    {
+        func.native(args, &ret);
+        return ret;
+    }
+    func.hotness++;
+    size_t params = func.proto.args().size();
+    SmallVector<Cell, 16> frame(func.slots);
+    copy(args, args + params, frame.begin());
+    return eval(func, func.root, frame.data());
+}
+
+Interpreter::Cell Interpreter::eval(FunctionCode &func, NodeId id, Cell *frame)
+{
+    const Node &node = func.nodes[id];
+    Cell result = {};
+    switch (node.op)
+    {
+    case OP_CONST:
+        return node.constant;
+    case OP_LOAD:
+        return frame[node.slot];
+    case OP_STORE:
+        frame[node.slot] = eval(func, node.binary.lhs, frame);
+        return frame[node.slot];
+    case OP_CONVERT:
+    {
+        Cell value = eval(func, node.binary.lhs, frame);
+        switch (node.conversion)
+        {
+        case CONV_DOUBLE_TO_INT:
+            result.i = (int64_t)value.d;
+            break;
+        case CONV_DOUBLE_TO_BOOL:
+            result.i = value.d < 0 || value.d > 0;
+            break;
+        case CONV_INT_TO_DOUBLE:
+        case CONV_BOOL_TO_DOUBLE:
+            result.d = (double)value.i;
+            break;
+        case CONV_INT_TO_BOOL:
+            result.i = value.i != 0;
+            break;
+        }
+        return result;
+    }
+    case OP_FADD:
+    case OP_FSUB:
+    case OP_FMUL:
+    case OP_FLT:
+    {
+        // 先求lhs再求rhs, 与IR中的顺序一致
+        double lhs = eval(func, node.binary.lhs, frame).d;
+        double rhs = eval(func, node.binary.rhs, frame).d;
+        switch (node.op)
+        {
+        case OP_FADD:
+            result.d = lhs + rhs;
+            break;
+        case OP_FSUB:
+            result.d = lhs - rhs;
+            break;
+        case OP_FMUL:
+            result.d = lhs * rhs;
+            break;
+        default:
+            // fcmp ult: 小于或者有NaN
+            result.i = !(lhs >= rhs);
+            break;
+        }
+        return result;
+    }
+    case OP_IADD:
+    case OP_ISUB:
+    case OP_IMUL:
+    case OP_ILT:
+    {
+        // 整数运算溢出时回绕, 与没有nsw标记的add/sub/mul一致
+        uint64_t lhs = eval(func, node.binary.lhs, frame).i;
+        uint64_t rhs = eval(func, node.binary.rhs, frame).i;
+        switch (node.op)
+        {
+        case OP_IADD:
+            result.i = lhs + rhs;
+            break;
+        case OP_ISUB:
+            result.i = lhs - rhs;
+            break;
+        case OP_IMUL:
+            result.i = lhs * rhs;
+            break;
+        default:
+            result.i = (int64_t)lhs < (int64_t)rhs;
+            break;
+        }
+        return result;
+    }
+    case OP_SEQ:
+        eval(func, node.binary.lhs, frame);
+        return eval(func, node.binary.rhs, frame);
+    case OP_IF:
+    {
+        const NodeId *children = &func.children[node.list.first];
+        return eval(func, children[eval(func, children[0], frame).i ? 1 : 2], frame);
+    }
+    case OP_FOR:
+    {
+        // 与emitForExpr相同: 先检查一次条件, 每次执行body后再求step和条件
+        const NodeId *children = &func.children[node.list.first];
+        Cell &var = frame[node.slot];
+        var = eval(func, children[0], frame);
+        if (eval(func, children[1], frame).i)
+        {
+            do
+            {
+                eval(func, children[3], frame);
+                Cell step = eval(func, children[2], frame);
+                if (node.intLoop)
+                {
+                    var.i = (uint64_t)var.i + (uint64_t)step.i;
+                }
+                else
+                {
+                    var.d += step.d;
+                }
+                func.hotness++;
+            } while (eval(func, children[1], frame).i);
+        }
+        result.d = 0;
+        return result;
+    }
+    case OP_BLOCK:
+    {
+        const NodeId *children = &func.children[node.list.first];
+        for (uint32_t i = 0; i + 1 < node.list.count; i++)
+        {
+            eval(func, children[i], frame);
+        }
+        return eval(func, children[node.list.count - 1], frame);
+    }
+    case OP_CALL:
+    {
+        const NodeId *children = &func.children[node.list.first];
+        SmallVector<Cell, 8> args(node.list.count);
+        for (uint32_t i = 0; i < node.list.count; i++)
+        {
+            args[i] = eval(func, children[i], frame);
+        }
+        return call(*func.callees[node.slot], args.data());
+    }
+    }
+    return result;
+}
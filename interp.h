@@ -0,0 +1,138 @@
+#pragma once
+
+#include "kaleidoscope.h"
+
+// 分层执行的第一层: 不经过LLVM, 直接解释执行函数。
+// 函数定义先翻译为紧凑的节点数组, 翻译时按照IR生成的规则确定每个节点的类型并插入
+// 显式的类型转换, 解释执行时不再判断类型。函数的调用次数加上循环次数达到阈值后
+// 提升到JIT层, 之后解释器对它的调用都经由统一签名的入口函数进入JIT编译的代码。
+// 解释器不支持的函数(用到了数组)只交给JIT, 解释器同样经由入口函数调用它们和extern
+class Interpreter
+{
+public:
+    // 解释器中的值, 与JIT代码交换时每个值占64位, bool为0/1的i
+    union Cell
+    {
+        double d;
+        int64_t i;
+    };
+    // JIT层函数的入口: 从args读取参数, 调用函数, 结果写入ret
+    typedef void (*NativeEntry)(const Cell *args, Cell *ret);
+
+    enum Status
+    {
+        INTERP_OK,
+        INTERP_UNSUPPORTED, // 不能解释执行, 没有报错, 应当交给JIT
+        INTERP_FAILED       // 已经报错
+    };
+
+    enum Op : uint8_t
+    {
+        OP_CONST,
+        OP_LOAD,
+        OP_STORE,
+        OP_CONVERT,
+        OP_FADD,
+        OP_FSUB,
+        OP_FMUL,
+        OP_FLT,
+        OP_IADD,
+        OP_ISUB,
+        OP_IMUL,
+        OP_ILT,
+        OP_SEQ,
+        OP_IF,
+        OP_FOR,
+        OP_BLOCK,
+        OP_CALL
+    };
+
+    // OP_CONVERT的转换方式, 与convertValue生成的指令一一对应
+    enum Conversion : uint8_t
+    {
+        CONV_DOUBLE_TO_INT,  // fptosi
+        CONV_DOUBLE_TO_BOOL, // fcmp one 0.0
+        CONV_INT_TO_DOUBLE,  // sitofp
+        CONV_BOOL_TO_DOUBLE, // uitofp
+        CONV_INT_TO_BOOL     // icmp ne 0
+    };
+
+    typedef uint32_t NodeId;
+
+    struct Node
+    {
+        Op op;
+        Conversion conversion; // OP_CONVERT
+        bool intLoop;          // OP_FOR: 循环变量是int
+        // OP_LOAD/OP_STORE/OP_FOR: 变量在栈帧中的下标, OP_CALL: 被调函数在callees中的下标
+        uint32_t slot;
+        union
+        {
+            Cell constant; // OP_CONST
+            // 二元操作和OP_SEQ的两个操作数, OP_STORE/OP_CONVERT只用lhs
+            struct
+            {
+                NodeId lhs;
+                NodeId rhs;
+            } binary;
+            // OP_IF: cond/then/else, OP_FOR: start/cond/step/body, OP_BLOCK: 依次求值取最后一个,
+            // OP_CALL: 参数; 都在children[first, first + count)中
+            struct
+            {
+                uint32_t first;
+                uint32_t count;
+            } list;
+        };
+    };
+
+    struct FunctionCode
+    {
+        PrototypeAST proto;
+        vector<Node> nodes;
+        vector<NodeId> children;
+        vector<FunctionCode *> callees;
+        NodeId root = 0;
+        // 栈帧大小, 参数在最前面
+        uint32_t slots = 0;
+        // 有可以解释执行的函数体
+        bool interpreted = false;
+        // 调用次数加上循环次数
+        uint64_t hotness = 0;
+        // 提升到JIT层之后(或者不能解释执行时)的入口
+        NativeEntry native = nullptr;
+
+        FunctionCode(const PrototypeAST &proto) : proto(proto) {}
+    };
+
+private:
+    KaleidoscopeJIT &jit_;
+    shared_ptr<PrototypeTable> functionProtos_;
+    unsigned threshold_;
+    // 生成入口函数用, 与解释执行在同一个线程
+    unique_ptr<TargetMachine> targetMachine_;
+    unique_ptr<ASTContext> context_;
+    DenseMap<Symbol, unique_ptr<FunctionCode>> functions_;
+    // 执行中出现的错误(入口函数无法编译), 已经报错
+    bool failed_ = false;
+
+    friend class InterpTranslator;
+
+    // 函数name对应的FunctionCode, 第一次用到时根据记录的函数接口创建
+    FunctionCode *function(Symbol name, const PrototypeAST &proto);
+    // 编译func的入口函数, func本身由JIT提供
+    Expected<NativeEntry> buildEntry(const PrototypeAST &proto);
+
+    Cell call(FunctionCode &func, const Cell *args);
+    Cell eval(FunctionCode &func, NodeId id, Cell *frame);
+
+public:
+    // 函数被调用和循环的次数之和达到threshold后提升到JIT层
+    Interpreter(KaleidoscopeJIT &jit, shared_ptr<PrototypeTable> functionProtos, unsigned threshold);
+
+    // 翻译函数定义, 返回INTERP_OK时之后的调用都可以解释执行。
+    // 无论结果如何, 函数定义都还需要交给JIT(比如addLazyDefinition)
+    Status addFunction(const FunctionAST &func);
+
+    // 解释执行顶层表达式, 返回INTERP_OK时结果写入result
+    Status run(const FunctionAST &expr, double &result);
+};
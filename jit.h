@@ -0,0 +1,666 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "llvm/ADT/FunctionExtras.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/ThreadPool.h"
+
+#include "profile.h"
+
+using namespace llvm;
+
+// 保存在磁盘目录中的目标文件缓存, 文件名即key。
+// 只缓存identifier以kKeyPrefix开头的module, 其余module(比如顶层表达式)照常编译
+class ObjectFileCache : public ObjectCache
+{
+private:
+    std::string dir;
+
+    std::string path(StringRef key) const
+    {
+        SmallString<128> result(dir);
+        sys::path::append(result, key + ".o");
+        return result.str().str();
+    }
+
+public:
+    static constexpr const char *kKeyPrefix = "kal-";
+
+    explicit ObjectFileCache(StringRef dir) : dir(dir.str())
+    {
+        if (std::error_code ec = sys::fs::create_directories(dir))
+        {
+            errs() << "Error: cannot create cache directory " << dir << ": " << ec.message() << "\n";
+        }
+    }
+
+    // 未命中时返回nullptr
+    std::unique_ptr<MemoryBuffer> load(StringRef key) const
+    {
+        auto buffer = MemoryBuffer::getFile(path(key), /*IsText=*/false, /*RequiresNullTerminator=*/false);
+        if (!buffer)
+        {
+            return nullptr;
+        }
+        return std::move(*buffer);
+    }
+
+    // 先写入临时文件再改名, 多个kal进程同时写同一个key也不会读到不完整的文件
+    void store(StringRef key, MemoryBufferRef object) const
+    {
+        int fd;
+        SmallString<128> temp;
+        if (sys::fs::createUniqueFile(path(key) + ".%%%%%%.tmp", fd, temp))
+        {
+            return;
+        }
+        {
+            raw_fd_ostream os(fd, /*shouldClose=*/true);
+            os << object.getBuffer();
+        }
+        if (sys::fs::rename(temp, path(key)))
+        {
+            sys::fs::remove(temp);
+        }
+    }
+
+    void notifyObjectCompiled(const Module *module, MemoryBufferRef object) override
+    {
+        if (StringRef(module->getModuleIdentifier()).startswith(kKeyPrefix))
+        {
+            store(module->getModuleIdentifier(), object);
+        }
+    }
+
+    std::unique_ptr<MemoryBuffer> getObject(const Module *module) override
+    {
+        if (StringRef(module->getModuleIdentifier()).startswith(kKeyPrefix))
+        {
+            return load(module->getModuleIdentifier());
+        }
+        return nullptr;
+    }
+};
+
+// 把JIT代码中的函数写入perf的符号表/tmp/perf-<pid>.map, perf record/report据此把地址解析为函数名。
+// 目标文件释放后地址可能被复用, 但perf map不能删除条目, 这种情况下以后写入的为准
+class PerfMapListener : public JITEventListener
+{
+private:
+    std::mutex lock;
+    std::unique_ptr<raw_fd_ostream> os;
+
+public:
+    PerfMapListener()
+    {
+        std::string path = ("/tmp/perf-" + Twine(sys::Process::getProcessId()) + ".map").str();
+        std::error_code ec;
+        os = std::make_unique<raw_fd_ostream>(path, ec, sys::fs::OF_Text);
+        if (ec)
+        {
+            errs() << "Error: cannot open " << path << ": " << ec.message() << "\n";
+            os.reset();
+        }
+    }
+
+    void notifyObjectLoaded(ObjectKey, const object::ObjectFile &object,
+                            const RuntimeDyld::LoadedObjectInfo &info) override
+    {
+        if (os == nullptr)
+        {
+            return;
+        }
+        // 调试用的目标文件中符号地址已经是加载后的地址
+        object::OwningBinary<object::ObjectFile> debug = info.getObjectForDebug(object);
+        const object::ObjectFile &loaded = debug.getBinary() ? *debug.getBinary() : object;
+        std::lock_guard<std::mutex> guard(lock);
+        for (const auto &symbol_size : object::computeSymbolSizes(loaded))
+        {
+            const object::SymbolRef &symbol = symbol_size.first;
+            auto type = symbol.getType();
+            auto name = symbol.getName();
+            auto address = symbol.getAddress();
+            if (!type || !name || !address || *type != object::SymbolRef::ST_Function || symbol_size.second == 0)
+            {
+                consumeError(type.takeError());
+                consumeError(name.takeError());
+                consumeError(address.takeError());
+                continue;
+            }
+            *os << format("%llx %llx ", (unsigned long long)*address, (unsigned long long)symbol_size.second)
+                << *name << '\n';
+        }
+        os->flush();
+    }
+};
+
+// 按需把--profile-functions计数器的符号(FunctionProfiler::kSymbolPrefix + 函数名)
+// 定义为宿主进程中计数器的地址
+class ProfileCounterGenerator : public orc::DefinitionGenerator
+{
+private:
+    char globalPrefix;
+
+public:
+    explicit ProfileCounterGenerator(char globalPrefix) : globalPrefix(globalPrefix) {}
+
+    Error tryToGenerate(orc::LookupState &, orc::LookupKind, orc::JITDylib &dylib,
+                        orc::JITDylibLookupFlags, const orc::SymbolLookupSet &symbols) override
+    {
+        orc::SymbolMap counters;
+        for (auto &symbol : symbols)
+        {
+            StringRef name = *symbol.first;
+            if (globalPrefix != '\0' && !name.consume_front(StringRef(&globalPrefix, 1)))
+            {
+                continue;
+            }
+            if (name.consume_front(FunctionProfiler::kSymbolPrefix))
+            {
+                counters[symbol.first] = JITEvaluatedSymbol(
+                    pointerToJITTargetAddress(FunctionProfiler::instance().counters(name)),
+                    JITSymbolFlags::Exported);
+            }
+        }
+        if (counters.empty())
+        {
+            return Error::success();
+        }
+        return dylib.define(orc::absoluteSymbols(std::move(counters)));
+    }
+};
+
+// 生成单个函数所在module的回调, 在函数第一次被调用时执行
+typedef unique_function<Expected<orc::ThreadSafeModule>()> ModuleGenerator;
+
+// 只有一个函数符号的MaterializationUnit, 被请求时才调用generator生成IR,
+// 把其中的函数name改名为bodyName后交给LLJIT的IR层编译。对象缓存中有cacheKey时直接加载目标文件
+class LazyFunctionMaterializationUnit : public orc::MaterializationUnit
+{
+private:
+    orc::IRLayer &irLayer;
+    orc::ObjectLayer &objectLayer;
+    ObjectFileCache *cache;
+    std::string name;
+    std::string bodyName;
+    std::string cacheKey;
+    ModuleGenerator generator;
+
+public:
+    LazyFunctionMaterializationUnit(orc::IRLayer &irLayer, orc::ObjectLayer &objectLayer,
+                                    ObjectFileCache *cache, orc::SymbolStringPtr symbol,
+                                    StringRef name, StringRef bodyName, StringRef cacheKey,
+                                    ModuleGenerator generator)
+        : MaterializationUnit(Interface(
+              orc::SymbolFlagsMap{{symbol, JITSymbolFlags::Exported | JITSymbolFlags::Callable}},
+              nullptr)),
+          irLayer(irLayer), objectLayer(objectLayer), cache(cache),
+          name(name.str()), bodyName(bodyName.str()), cacheKey(cacheKey.str()),
+          generator(std::move(generator))
+    {
+    }
+
+    StringRef getName() const override { return name; }
+
+    void materialize(std::unique_ptr<orc::MaterializationResponsibility> responsibility) override
+    {
+        if (cache != nullptr && !cacheKey.empty())
+        {
+            if (auto object = cache->load(cacheKey))
+            {
+                objectLayer.emit(std::move(responsibility), std::move(object));
+                return;
+            }
+        }
+        auto module = generator();
+        if (!module)
+        {
+            responsibility->getExecutionSession().reportError(module.takeError());
+            responsibility->failMaterialization();
+            return;
+        }
+        module->withModuleDo([this](Module &m)
+                             {
+                                 if (Function *func = m.getFunction(name))
+                                 {
+                                     func->setName(bodyName);
+                                 } });
+        irLayer.emit(std::move(responsibility), std::move(*module));
+    }
+
+private:
+    // 函数体还没有生成过, 被覆盖时什么都不用做
+    void discard(const orc::JITDylib &, const orc::SymbolStringPtr &) override {}
+};
+
+// 基于ORC LLJIT的即时编译引擎
+class KaleidoscopeJIT
+{
+private:
+    // 有编译线程时执行ExecutionSession派发的编译任务。LLJIT自己的线程池无法等待,
+    // 释放module之前要等进行中的任务(比如onObjEmit)结束, 否则ResourceTracker会在使用中失效。
+    // 声明在lljit之前, 比lljit后析构
+    std::unique_ptr<ThreadPool> dispatchPool;
+    std::unique_ptr<orc::LLJIT> lljit;
+    // 函数定义name的函数体编译为name.body, 调用者经由main JITDylib中名为name的间接跳转桩调用它。
+    // 桩一开始指向lazy call-through的跳板, 第一次被调用时才查找(编译)函数体并让桩直接指向它。
+    // 第一次定义函数时才创建
+    std::unique_ptr<orc::LazyCallThroughManager> callThroughManager;
+    std::unique_ptr<orc::IndirectStubsManager> stubsManager;
+    // 每个函数定义的函数体有自己的ResourceTracker, 重新定义时只删除并编译这一个函数,
+    // 更新桩之后调用者不需要重新编译
+    StringMap<orc::ResourceTrackerSP> definitions;
+    ObjectFileCache *cache = nullptr;
+    orc::JITTargetMachineBuilder machineBuilder;
+    std::string targetKey_;
+
+    static void lazyCompileFailed()
+    {
+        report_fatal_error("kal: failed to compile a lazily defined function");
+    }
+
+    static std::string bodyName(StringRef name)
+    {
+        return (name + ".body").str();
+    }
+
+    Error initStubs()
+    {
+        const Triple &triple = lljit->getTargetTriple();
+        auto manager = orc::createLocalLazyCallThroughManager(
+            triple, lljit->getExecutionSession(), pointerToJITTargetAddress(&lazyCompileFailed));
+        if (!manager)
+        {
+            return manager.takeError();
+        }
+        callThroughManager = std::move(*manager);
+        auto stubs = orc::createLocalIndirectStubsManagerBuilder(triple);
+        if (!stubs)
+        {
+            return make_error<StringError>("lazy compilation is not supported on " + triple.str(),
+                                           inconvertibleErrorCode());
+        }
+        stubsManager = stubs();
+        return Error::success();
+    }
+
+    // 用add在tracker中加入name的新函数体(定义name.body), 删除之前的函数体, 再让桩name指向新的。
+    // compileNow时立即编译函数体, 否则桩指向跳板, 第一次调用时才编译
+    Error defineBody(StringRef name, bool compileNow,
+                     function_ref<Error(const orc::ResourceTrackerSP &)> add)
+    {
+        PhaseScope scope(PHASE_JIT);
+        if (stubsManager == nullptr)
+        {
+            if (Error err = initStubs())
+            {
+                return err;
+            }
+        }
+        orc::JITDylib &main = lljit->getMainJITDylib();
+        orc::ResourceTrackerSP &tracker = definitions[name];
+        bool redefined = tracker != nullptr;
+        if (redefined)
+        {
+            // 新旧函数体同名, 先删除旧的
+            if (Error err = tracker->remove())
+            {
+                return err;
+            }
+        }
+        tracker = main.createResourceTracker();
+        JITTargetAddress address = pointerToJITTargetAddress(&lazyCompileFailed);
+        Error err = add(tracker);
+        if (!err && compileNow)
+        {
+            if (auto symbol = lljit->lookup(bodyName(name)))
+            {
+                address = symbol->getAddress();
+            }
+            else
+            {
+                err = symbol.takeError();
+            }
+        }
+        else if (!err)
+        {
+            auto trampoline = callThroughManager->getCallThroughTrampoline(
+                main, lljit->mangleAndIntern(bodyName(name)),
+                [this, name = name.str()](JITTargetAddress resolved)
+                { return stubsManager->updatePointer(name, resolved); });
+            if (trampoline)
+            {
+                address = *trampoline;
+            }
+            else
+            {
+                err = trampoline.takeError();
+            }
+        }
+        if (redefined)
+        {
+            // 失败时桩指向lazyCompileFailed, 不能指向已经删除的函数体
+            if (Error update = stubsManager->updatePointer(name, address))
+            {
+                return joinErrors(std::move(err), std::move(update));
+            }
+            return err;
+        }
+        if (!err)
+        {
+            err = stubsManager->createStub(name, address, JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+        }
+        if (!err)
+        {
+            orc::SymbolMap symbols;
+            symbols[lljit->mangleAndIntern(name)] = stubsManager->findStub(name, false);
+            // name已经有别的定义(比如addModule加入的)时失败
+            err = main.define(orc::absoluteSymbols(std::move(symbols)));
+        }
+        if (err)
+        {
+            consumeError(definitions[name]->remove());
+            definitions.erase(name);
+        }
+        return err;
+    }
+
+public:
+    KaleidoscopeJIT(std::unique_ptr<orc::LLJIT> lljit, orc::JITTargetMachineBuilder machineBuilder)
+        : lljit(std::move(lljit)), machineBuilder(std::move(machineBuilder)),
+          targetKey_(hostTargetKey(this->lljit->getTargetTriple())) {}
+
+    ~KaleidoscopeJIT()
+    {
+        if (dispatchPool)
+        {
+            dispatchPool->wait();
+        }
+    }
+
+    // compile_threads大于0时, module在后台线程中并发编译。
+    // cache不为空时编译出的目标文件写入cache, 生命期必须长于JIT
+    static Expected<std::unique_ptr<KaleidoscopeJIT>> Create(unsigned compile_threads = 0,
+                                                             ObjectFileCache *cache = nullptr)
+    {
+        auto machineBuilder = orc::JITTargetMachineBuilder::detectHost();
+        if (!machineBuilder)
+        {
+            return machineBuilder.takeError();
+        }
+        orc::LLJITBuilder builder;
+        builder.setJITTargetMachineBuilder(*machineBuilder);
+        builder.setNumCompileThreads(compile_threads);
+        if (cache != nullptr)
+        {
+            // 与LLJIT默认的编译器相同, 只是多了cache
+            builder.setCompileFunctionCreator(
+                [compile_threads, cache](orc::JITTargetMachineBuilder jtmb)
+                    -> Expected<std::unique_ptr<orc::IRCompileLayer::IRCompiler>>
+                {
+                    if (compile_threads > 0)
+                    {
+                        return std::make_unique<orc::ConcurrentIRCompiler>(std::move(jtmb), cache);
+                    }
+                    auto tm = jtmb.createTargetMachine();
+                    if (!tm)
+                    {
+                        return tm.takeError();
+                    }
+                    return std::make_unique<orc::TMOwningSimpleCompiler>(std::move(*tm), cache);
+                });
+        }
+        auto lljit = builder.create();
+        if (!lljit)
+        {
+            return lljit.takeError();
+        }
+        char global_prefix = (*lljit)->getDataLayout().getGlobalPrefix();
+        (*lljit)->getMainJITDylib().addGenerator(std::make_unique<ProfileCounterGenerator>(global_prefix));
+        // 让JIT代码可以解析宿主进程中的符号，比如libm中的sin/cos
+        auto generator = orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            global_prefix);
+        if (!generator)
+        {
+            return generator.takeError();
+        }
+        (*lljit)->getMainJITDylib().addGenerator(std::move(*generator));
+        auto jit = std::make_unique<KaleidoscopeJIT>(std::move(*lljit), std::move(*machineBuilder));
+        jit->cache = cache;
+        if (compile_threads > 0)
+        {
+            // 代替LLJIT的派发, 与LLJIT的做法相同: ThreadPool的任务必须可复制, 只能传裸指针
+            jit->dispatchPool = std::make_unique<ThreadPool>(hardware_concurrency(compile_threads));
+            jit->lljit->getExecutionSession().setDispatchTask(
+                [pool = jit->dispatchPool.get()](std::unique_ptr<orc::Task> task)
+                {
+                    pool->async([unowned = task.release()]()
+                                {
+                                    std::unique_ptr<orc::Task> owned(unowned);
+                                    owned->run(); });
+                });
+        }
+        return jit;
+    }
+
+    // 之后加载的每个目标文件都通知listener(比如perf和GDB的JIT接口), listener的生命期必须长于JIT
+    Error addEventListener(JITEventListener &listener)
+    {
+        auto *layer = dyn_cast<orc::RTDyldObjectLinkingLayer>(&lljit->getObjLinkingLayer());
+        if (layer == nullptr)
+        {
+            return make_error<StringError>("the object linking layer does not support JIT event listeners",
+                                           inconvertibleErrorCode());
+        }
+        layer->registerJITEventListener(listener);
+        return Error::success();
+    }
+
+    const DataLayout &dataLayout() const
+    {
+        return lljit->getDataLayout();
+    }
+
+    // 创建与JIT编译时配置相同的TargetMachine, 供IR优化pass查询目标机器的代价模型。
+    // TargetMachine不是线程安全的, 每个线程各自创建
+    Expected<std::unique_ptr<TargetMachine>> createTargetMachine()
+    {
+        return machineBuilder.createTargetMachine();
+    }
+
+    // 决定生成代码的目标机器描述, 用作对象缓存key的一部分
+    const std::string &targetKey() const { return targetKey_; }
+
+private:
+    static std::string hostTargetKey(const Triple &triple)
+    {
+        std::string key = triple.str() + "-" + sys::getHostCPUName().str();
+        StringMap<bool> features;
+        if (sys::getHostCPUFeatures(features))
+        {
+            std::vector<std::string> enabled;
+            for (auto &feature : features)
+            {
+                if (feature.second)
+                {
+                    enabled.push_back(feature.first().str());
+                }
+            }
+            std::sort(enabled.begin(), enabled.end());
+            for (auto &feature : enabled)
+            {
+                key += "," + feature;
+            }
+        }
+        return key;
+    }
+
+public:
+    // 直接加入编译好的目标文件, 比如从对象缓存中读出的
+    Error addObject(std::unique_ptr<MemoryBuffer> object)
+    {
+        PhaseScope scope(PHASE_JIT);
+        return lljit->addObjectFile(std::move(object));
+    }
+
+    // 添加常驻JIT的module, 其中的函数不能重新定义
+    Error addModule(orc::ThreadSafeModule module)
+    {
+        PhaseScope scope(PHASE_JIT);
+        return lljit->addIRModule(std::move(module));
+    }
+
+    // 定义(或重新定义)函数name, module中只有它的定义。
+    // 重新定义时接口必须相同, 只编译新的函数体, 已经编译的调用者经由桩调用新的函数体。
+    // compileNow时立即编译, 否则第一次被调用时才编译
+    Error addDefinition(StringRef name, orc::ThreadSafeModule module, bool compileNow = false)
+    {
+        module.withModuleDo([name](Module &m)
+                            {
+                                if (Function *func = m.getFunction(name))
+                                {
+                                    func->setName(bodyName(name));
+                                } });
+        return defineBody(name, compileNow, [&](const orc::ResourceTrackerSP &tracker)
+                          { return lljit->addIRModule(tracker, std::move(module)); });
+    }
+
+    // 立即编译函数定义name的函数体并让桩直接指向它, 之后的调用不再经过跳板。
+    // name不是函数定义(比如宿主函数)时什么都不做。函数体调用的其他定义仍然在第一次被调用时才编译
+    Error compileDefinition(StringRef name)
+    {
+        if (definitions.count(name) == 0)
+        {
+            return Error::success();
+        }
+        PhaseScope scope(PHASE_JIT);
+        auto symbol = lljit->lookup(bodyName(name));
+        if (!symbol)
+        {
+            return symbol.takeError();
+        }
+        return stubsManager->updatePointer(name, symbol->getAddress());
+    }
+
+    // 与addDefinition相同, 但函数体是编译好的目标文件, 比如对象缓存中由addDefinition
+    // 或addLazyFunction编译出的
+    Error addDefinitionObject(StringRef name, std::unique_ptr<MemoryBuffer> object)
+    {
+        return defineBody(name, false, [&](const orc::ResourceTrackerSP &tracker)
+                          { return lljit->addObjectFile(tracker, std::move(object)); });
+    }
+
+    // 与addDefinition相同, 但直到函数第一次被调用时才调用generator生成并编译函数体。
+    // cacheKey不为空时先在对象缓存中查找
+    Error addLazyFunction(StringRef name, StringRef cacheKey, ModuleGenerator generator)
+    {
+        return defineBody(name, false, [&](const orc::ResourceTrackerSP &tracker)
+                          { return lljit->getMainJITDylib().define(
+                                std::make_unique<LazyFunctionMaterializationUnit>(
+                                    lljit->getIRTransformLayer(), lljit->getObjLinkingLayer(), cache,
+                                    lljit->mangleAndIntern(bodyName(name)), name, bodyName(name),
+                                    cacheKey, std::move(generator)),
+                                tracker); });
+    }
+
+    // 把宿主程序中的函数或数据定义为符号name, JIT代码直接调用该地址,
+    // 优先于在宿主进程中按名字查找到的符号
+    Error addHostSymbol(StringRef name, JITTargetAddress address)
+    {
+        orc::SymbolMap symbols;
+        symbols[lljit->mangleAndIntern(name)] =
+            JITEvaluatedSymbol(address, JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+        return lljit->getMainJITDylib().define(orc::absoluteSymbols(std::move(symbols)));
+    }
+
+    Expected<JITEvaluatedSymbol> lookup(StringRef name)
+    {
+        return lljit->lookup(name);
+    }
+
+    // 编译好的顶层表达式, 可以在任意线程中调用, 之后用release()释放
+    struct Expression
+    {
+        double (*func)() = nullptr;
+        orc::ResourceTrackerSP tracker;
+    };
+
+    // 编译module中的函数name(以及它依赖的函数定义)。同时存在的多个表达式的name必须不同
+    Expected<Expression> compileExpression(orc::ThreadSafeModule module, StringRef name)
+    {
+        PhaseScope jit_scope(PHASE_JIT);
+        Expression expr;
+        expr.tracker = lljit->getMainJITDylib().createResourceTracker();
+        if (Error err = lljit->addIRModule(expr.tracker, std::move(module)))
+        {
+            return err;
+        }
+        // 查找符号时才真正编译module及其依赖的函数定义
+        auto symbol = lljit->lookup(name);
+        if (!symbol)
+        {
+            consumeError(release(expr));
+            return symbol.takeError();
+        }
+        expr.func = jitTargetAddressToFunction<double (*)()>(symbol->getAddress());
+        return expr;
+    }
+
+    // 释放表达式所在module占用的全部内存, 表达式不能再被调用
+    Error release(Expression &expr)
+    {
+        PhaseScope jit_scope(PHASE_JIT);
+        if (dispatchPool)
+        {
+            dispatchPool->wait();
+        }
+        expr.func = nullptr;
+        return expr.tracker->remove();
+    }
+
+    // 编译module并以double(*)()的形式调用其中的函数name, 执行完毕后释放该module
+    // 占用的全部内存
+    Expected<double> evaluate(orc::ThreadSafeModule module, StringRef name)
+    {
+        auto expr = compileExpression(std::move(module), name);
+        if (!expr)
+        {
+            return expr.takeError();
+        }
+        double result;
+        {
+            PhaseScope execute_scope(PHASE_EXECUTE);
+            result = expr->func();
+        }
+        if (Error err = release(*expr))
+        {
+            return err;
+        }
+        return result;
+    }
+};
@@ -0,0 +1,2204 @@
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kaleidoscope.h"
+
+cl::OptionCategory g_kal_category("kal options");
+
+raw_ostream &traceStream()
+{
+    static raw_fd_ostream stream(STDERR_FILENO, false);
+    static bool init = (stream.SetBufferSize(64 * 1024), true);
+    (void)init;
+    return stream;
+}
+
+#ifdef KAL_ENABLE_TRACE
+cl::opt<bool> g_trace_parse("trace-parse", cl::desc("Trace the parser"),
+                            cl::cat(g_kal_category));
+#endif
+
+cl::opt<bool> g_simplify_ast("simplify-ast", cl::desc("Fold constants and share common subexpressions while parsing"),
+                             cl::init(true), cl::cat(g_kal_category));
+
+cl::opt<bool> g_fast_math("fast-math", cl::desc("Allow reassociation and other unsafe floating point optimizations"),
+                          cl::cat(g_kal_category));
+
+cl::opt<bool> g_profile_functions("profile-functions",
+                                  cl::desc("Count calls and self cycles of each JIT-compiled function definition, "
+                                           "report at exit"),
+                                  cl::cat(g_kal_category));
+
+void addOptimizationPasses(legacy::FunctionPassManager &fpm, unsigned level,
+                           TargetMachine *targetMachine)
+{
+    if (targetMachine != nullptr)
+    {
+        fpm.add(createTargetTransformInfoWrapperPass(targetMachine->getTargetIRAnalysis()));
+    }
+    if (level == 0)
+    {
+        // 自递归的尾调用总是改写为循环, 否则深递归会栈溢出。
+        // 尾调用消除需要先把参数的alloca提升为寄存器
+        fpm.add(createPromoteMemoryToRegisterPass());
+        fpm.add(createTailCallEliminationPass());
+        return;
+    }
+    // 把变量的alloca拆分并提升为寄存器, 后续pass都在SSA值上工作
+    fpm.add(createSROAPass());
+    if (level >= 3)
+    {
+        // 先做一遍廉价的公共子表达式消除，减少后续pass的工作量
+        fpm.add(createEarlyCSEPass());
+    }
+    // 窥孔优化和位运算级别的化简
+    fpm.add(createInstructionCombiningPass());
+    // 重新组合算术表达式，便于常量折叠
+    fpm.add(createReassociatePass());
+    if (level >= 2)
+    {
+        // 消除冗余的公共子表达式
+        fpm.add(createGVNPass());
+    }
+    // 化简控制流图，比如删除不可达的block
+    fpm.add(createCFGSimplificationPass());
+    // 把尾调用标记为tail, 自递归的尾调用改写为循环
+    fpm.add(createTailCallEliminationPass());
+    if (level >= 2)
+    {
+        // 循环优化: 把double的归纳变量改写为整数以便计算循环次数, 提出循环不变量,
+        // 然后向量化和展开
+        fpm.add(createIndVarSimplifyPass());
+        fpm.add(createLICMPass());
+        fpm.add(createLoopVectorizePass());
+        fpm.add(createLoopUnrollPass(level));
+        fpm.add(createInstructionCombiningPass());
+        fpm.add(createCFGSimplificationPass());
+    }
+    if (level >= 3)
+    {
+        // GVN之后再做一轮化简
+        fpm.add(createInstructionCombiningPass());
+        fpm.add(createDeadCodeEliminationPass());
+    }
+}
+
+void ASTContext::optimizeModule()
+{
+    if (optLevel == 0)
+    {
+        return;
+    }
+    PhaseScope scope(PHASE_OPTIMIZE);
+    legacy::PassManager pass_manager;
+    if (targetMachine != nullptr)
+    {
+        // 内联的代价模型和libm函数的属性都与目标机器有关
+        pass_manager.add(createTargetTransformInfoWrapperPass(targetMachine->getTargetIRAnalysis()));
+        pass_manager.add(new TargetLibraryInfoWrapperPass(targetMachine->getTargetTriple()));
+    }
+    // extern声明的sin/cos等库函数的属性
+    pass_manager.add(createInferFunctionAttrsLegacyPass());
+    pass_manager.add(createIPSCCPPass());
+    // 自底向上推断readnone/nounwind等属性, 然后内联
+    pass_manager.add(createPostOrderFunctionAttrsLegacyPass());
+    pass_manager.add(createFunctionInliningPass(optLevel, 0, false));
+    pass_manager.add(createReversePostOrderFunctionAttrsPass());
+    pass_manager.run(*module);
+    // 内联进来的代码与调用者一起化简
+    for (Function &func : *module)
+    {
+        if (!func.isDeclaration())
+        {
+            passManager->run(func);
+        }
+    }
+}
+
+// 常量初始化, 不需要运行时构造
+BinopPrecedenceTable g_binop_precedence;
+
+SymbolTable g_symbols;
+
+const string g_anon_expr_name = "__anon_expr";
+
+//
+
+ExprAST *LogError(const char *str)
+{
+    if (ErrorCapture *capture = ErrorCapture::current())
+    {
+        capture->report(str);
+        return nullptr;
+    }
+    fprintf(stderr, "Error: %s\n", str);
+    return nullptr;
+}
+
+Value *LogErrorV(const char *str)
+{
+    LogError(str);
+    return nullptr;
+}
+
+thread_local ErrorCapture *ErrorCapture::current_ = nullptr;
+
+Error ErrorCapture::takeError()
+{
+    Error err = Error::success();
+    for (auto &message : messages_)
+    {
+        err = joinErrors(move(err), make_error<StringError>(message, inconvertibleErrorCode()));
+    }
+    messages_.clear();
+    return err;
+}
+
+Value *convertValue(IRBuilder<> &builder, Value *value, Type *type)
+{
+    Type *from = value->getType();
+    if (from == type)
+    {
+        return value;
+    }
+    if (from->isPointerTy() || type->isPointerTy())
+    {
+        return LogErrorV("array used where a number is expected");
+    }
+    if (type->isIntegerTy(1))
+    {
+        // 非0即为真
+        return from->isDoubleTy()
+                   ? builder.CreateFCmpONE(value, ConstantFP::get(from, 0.0), "tobool")
+                   : builder.CreateICmpNE(value, ConstantInt::get(from, 0), "tobool");
+    }
+    if (type->isDoubleTy())
+    {
+        // bool是无符号的0/1, int是有符号的
+        return from->isIntegerTy(1) ? builder.CreateUIToFP(value, type, "todouble")
+                                    : builder.CreateSIToFP(value, type, "todouble");
+    }
+    return from->isDoubleTy() ? builder.CreateFPToSI(value, type, "toint")
+                              : builder.CreateZExt(value, type, "toint");
+}
+
+// 字面量都解析为double, 另一边是整数时把整数值的字面量直接当作i64,
+// 避免 i + 1 这样的表达式退化为浮点运算
+static Value *integralConstant(Value *value, Type *int_type)
+{
+    auto *constant = dyn_cast<ConstantFP>(value);
+    if (constant == nullptr)
+    {
+        return value;
+    }
+    APSInt result(64, false);
+    bool exact = false;
+    constant->getValueAPF().convertToInteger(result, APFloat::rmTowardZero, &exact);
+    return exact ? ConstantInt::get(int_type, result) : value;
+}
+
+Value *emitBinaryOp(ASTContext &context, char op, Value *lhs, Value *rhs)
+{
+    IRBuilder<> &builder = context.irBuilder;
+    if (op == ':')
+    {
+        // lhs只为了副作用求值
+        return rhs;
+    }
+    if (lhs->getType()->isPointerTy() || rhs->getType()->isPointerTy())
+    {
+        return LogErrorV("array operands are only allowed inside sum, min, max and store");
+    }
+    // 两边都是整数(i64或i1)时使用整数运算, 否则都转为double
+    Type *int_type = Type::getInt64Ty(context.llvmContext);
+    if (lhs->getType()->isIntegerTy() || rhs->getType()->isIntegerTy())
+    {
+        lhs = integralConstant(lhs, int_type);
+        rhs = integralConstant(rhs, int_type);
+    }
+    Type *type = lhs->getType()->isDoubleTy() || rhs->getType()->isDoubleTy()
+                     ? Type::getDoubleTy(context.llvmContext)
+                     : int_type;
+    lhs = convertValue(builder, lhs, type);
+    rhs = convertValue(builder, rhs, type);
+    bool is_double = type->isDoubleTy();
+    switch (op)
+    {
+    case '<':
+        // 比较的结果是bool(i1), 用作条件时不需要再和0比较
+        return is_double ? builder.CreateFCmpULT(lhs, rhs, "cmptmp")
+                         : builder.CreateICmpSLT(lhs, rhs, "cmptmp");
+    case '+':
+        return is_double ? builder.CreateFAdd(lhs, rhs, "addtmp") : builder.CreateAdd(lhs, rhs, "addtmp");
+    case '-':
+        return is_double ? builder.CreateFSub(lhs, rhs, "subtmp") : builder.CreateSub(lhs, rhs, "subtmp");
+    case '*':
+        return is_double ? builder.CreateFMul(lhs, rhs, "multmp") : builder.CreateMul(lhs, rhs, "multmp");
+    default:
+        return LogErrorV("invalid binary operator");
+    }
+}
+
+namespace ast_hash
+{
+    // 缓存格式或IR生成方式变化时修改, 使旧的缓存失效
+    const char *const kVersion = "kal-cache-9";
+
+    void kind(MD5 &hasher, ExprKind kind)
+    {
+        hasher.update(ArrayRef<uint8_t>((uint8_t)kind));
+    }
+    void number(MD5 &hasher, double val)
+    {
+        hasher.update(ArrayRef<uint8_t>(reinterpret_cast<const uint8_t *>(&val), sizeof(val)));
+    }
+    void symbol(MD5 &hasher, Symbol symbol)
+    {
+        // 符号ID与解析顺序有关, 只能用名字
+        hasher.update(g_symbols.name(symbol));
+        hasher.update(ArrayRef<uint8_t>((uint8_t)0));
+    }
+    void op(MD5 &hasher, char op)
+    {
+        hasher.update(ArrayRef<uint8_t>((uint8_t)op));
+    }
+    void count(MD5 &hasher, uint32_t count)
+    {
+        hasher.update(ArrayRef<uint8_t>(reinterpret_cast<const uint8_t *>(&count), sizeof(count)));
+    }
+    void type(MD5 &hasher, ValueType type)
+    {
+        hasher.update(ArrayRef<uint8_t>((uint8_t)type));
+    }
+}
+
+void hashExpr(MD5 &hasher, const ExprAST *expr)
+{
+    ast_hash::kind(hasher, expr->kind());
+    switch (expr->kind())
+    {
+    case EXPR_NUMBER:
+        ast_hash::number(hasher, cast<NumberExprAST>(expr)->val());
+        break;
+    case EXPR_VARIABLE:
+        ast_hash::symbol(hasher, cast<VariableExprAST>(expr)->name());
+        break;
+    case EXPR_BINARY:
+    {
+        auto *binary = cast<BinaryExprAST>(expr);
+        ast_hash::op(hasher, binary->op());
+        hashExpr(hasher, binary->lhs());
+        hashExpr(hasher, binary->rhs());
+        break;
+    }
+    case EXPR_CALL:
+    {
+        auto *call = cast<CallExprAST>(expr);
+        ast_hash::symbol(hasher, call->callee());
+        ast_hash::count(hasher, call->args().size());
+        for (const ExprAST *arg : call->args())
+        {
+            hashExpr(hasher, arg);
+        }
+        break;
+    }
+    case EXPR_IF:
+    {
+        auto *branch = cast<IfExprAST>(expr);
+        hashExpr(hasher, branch->cond());
+        hashExpr(hasher, branch->thenExpr());
+        hashExpr(hasher, branch->elseExpr());
+        break;
+    }
+    case EXPR_FOR:
+    {
+        auto *loop = cast<ForExprAST>(expr);
+        ast_hash::symbol(hasher, loop->var());
+        ast_hash::type(hasher, loop->type());
+        hashExpr(hasher, loop->start());
+        hashExpr(hasher, loop->end());
+        hashExpr(hasher, loop->step());
+        hashExpr(hasher, loop->body());
+        break;
+    }
+    case EXPR_VAR:
+    {
+        auto *var = cast<VarExprAST>(expr);
+        ast_hash::count(hasher, var->names().size());
+        for (size_t i = 0; i < var->names().size(); i++)
+        {
+            ast_hash::symbol(hasher, var->names()[i]);
+            ast_hash::type(hasher, var->types()[i]);
+            hashExpr(hasher, var->inits()[i]);
+        }
+        hashExpr(hasher, var->body());
+        break;
+    }
+    }
+}
+
+static void collectCallees(const ExprAST *expr, SmallVectorImpl<Symbol> &result)
+{
+    // 纯表达式中没有调用, 共享的子树也不用重复遍历
+    if (expr->pure())
+    {
+        return;
+    }
+    switch (expr->kind())
+    {
+    case EXPR_NUMBER:
+    case EXPR_VARIABLE:
+        break;
+    case EXPR_BINARY:
+    {
+        auto *binary = cast<BinaryExprAST>(expr);
+        collectCallees(binary->lhs(), result);
+        collectCallees(binary->rhs(), result);
+        break;
+    }
+    case EXPR_CALL:
+    {
+        auto *call = cast<CallExprAST>(expr);
+        if (!g_symbols.isBuiltin(call->callee()))
+        {
+            result.push_back(call->callee());
+        }
+        for (const ExprAST *arg : call->args())
+        {
+            collectCallees(arg, result);
+        }
+        break;
+    }
+    case EXPR_IF:
+    {
+        auto *branch = cast<IfExprAST>(expr);
+        collectCallees(branch->cond(), result);
+        collectCallees(branch->thenExpr(), result);
+        collectCallees(branch->elseExpr(), result);
+        break;
+    }
+    case EXPR_FOR:
+    {
+        auto *loop = cast<ForExprAST>(expr);
+        collectCallees(loop->start(), result);
+        collectCallees(loop->end(), result);
+        collectCallees(loop->step(), result);
+        collectCallees(loop->body(), result);
+        break;
+    }
+    case EXPR_VAR:
+    {
+        auto *var = cast<VarExprAST>(expr);
+        for (const ExprAST *init : var->inits())
+        {
+            collectCallees(init, result);
+        }
+        collectCallees(var->body(), result);
+        break;
+    }
+    }
+}
+
+void FunctionAST::callees(SmallVectorImpl<Symbol> &result) const
+{
+    if (flatBody_)
+    {
+        flatBody_->callees(result);
+    }
+    else
+    {
+        collectCallees(body_, result);
+    }
+}
+
+string FunctionAST::cacheKey(StringRef target, unsigned optLevel) const
+{
+    MD5 hasher;
+    hasher.update(ast_hash::kVersion);
+    hasher.update(target);
+    ast_hash::count(hasher, optLevel);
+    ast_hash::count(hasher, g_fast_math ? 1 : 0);
+    ast_hash::count(hasher, g_profile_functions ? 1 : 0);
+    ast_hash::symbol(hasher, proto_->name());
+    ast_hash::count(hasher, proto_->args().size());
+    for (size_t i = 0; i < proto_->args().size(); i++)
+    {
+        ast_hash::symbol(hasher, proto_->args()[i]);
+        ast_hash::type(hasher, proto_->argTypes()[i]);
+    }
+    ast_hash::type(hasher, proto_->returnType());
+    ast_hash::count(hasher, memoized_ ? 1 : 0);
+    if (flatBody_)
+    {
+        flatBody_->hash(hasher);
+    }
+    else
+    {
+        hashExpr(hasher, body_);
+    }
+    MD5::MD5Result result;
+    hasher.final(result);
+    return (ObjectFileCache::kKeyPrefix + result.digest()).str();
+}
+
+// 每个记忆化函数的缓存表有1 << kMemoTableBits项
+static const unsigned kMemoTableBits = 12;
+
+void FunctionAST::emitMemoCache(ASTContext &context, Function *func, Function *compute) const
+{
+    LLVMContext &llvmContext = context.llvmContext;
+    IRBuilder<> &builder = context.irBuilder;
+    Type *i32 = builder.getInt32Ty();
+    Type *i64 = builder.getInt64Ty();
+    size_t arity = func->arg_size();
+    // { i32 lock, i32 valid, [arity x i64] keys, i64 result }
+    StructType *entry_type = StructType::get(llvmContext, {i32, i32, ArrayType::get(i64, arity), i64});
+    ArrayType *table_type = ArrayType::get(entry_type, 1ull << kMemoTableBits);
+    auto *table = new GlobalVariable(*context.module, table_type, false, GlobalValue::InternalLinkage,
+                                     ConstantAggregateZero::get(table_type), func->getName() + ".memo.table");
+    // 参数和结果都按64位的位模式存放, -0.0和0.0是不同的key
+    auto toBits = [&](Value *value) -> Value *
+    {
+        if (value->getType()->isDoubleTy())
+        {
+            return builder.CreateBitCast(value, i64);
+        }
+        return builder.CreateZExt(value, i64);
+    };
+    auto fromBits = [&](Value *bits, Type *type) -> Value *
+    {
+        if (type->isDoubleTy())
+        {
+            return builder.CreateBitCast(bits, type);
+        }
+        return builder.CreateTrunc(bits, type);
+    };
+    // 在当前block之后自旋直到拿到锁, 返回拿到锁之后的block
+    auto lock = [&](Value *lock_ptr, const Twine &name)
+    {
+        BasicBlock *spin = BasicBlock::Create(llvmContext, name, func);
+        builder.CreateBr(spin);
+        builder.SetInsertPoint(spin);
+        Value *old = builder.CreateAtomicRMW(AtomicRMWInst::Xchg, lock_ptr, builder.getInt32(1),
+                                             Align(4), AtomicOrdering::Acquire);
+        BasicBlock *locked = BasicBlock::Create(llvmContext, name + ".locked", func);
+        builder.CreateCondBr(builder.CreateICmpEQ(old, builder.getInt32(0)), locked, spin);
+        builder.SetInsertPoint(locked);
+    };
+    auto unlock = [&](Value *lock_ptr)
+    {
+        builder.CreateAlignedStore(builder.getInt32(0), lock_ptr, Align(4))->setAtomic(AtomicOrdering::Release);
+    };
+
+    builder.SetInsertPoint(BasicBlock::Create(llvmContext, "entry", func));
+    SmallVector<Value *, 8> args;
+    SmallVector<Value *, 8> keys;
+    Value *hash = builder.getInt64(arity);
+    for (Argument &arg : func->args())
+    {
+        args.push_back(&arg);
+        keys.push_back(toBits(&arg));
+        hash = builder.CreateMul(builder.CreateXor(hash, keys.back()), builder.getInt64(0x9e3779b97f4a7c15ull));
+    }
+    Value *index = builder.CreateLShr(hash, 64 - kMemoTableBits, "memoidx");
+    Value *slot = builder.CreateInBoundsGEP(table_type, table, {builder.getInt64(0), index}, "memoslot");
+    Value *lock_ptr = builder.CreateStructGEP(entry_type, slot, 0);
+    Value *valid_ptr = builder.CreateStructGEP(entry_type, slot, 1);
+    Value *keys_ptr = builder.CreateStructGEP(entry_type, slot, 2);
+    Value *result_ptr = builder.CreateStructGEP(entry_type, slot, 3);
+    auto keyPtr = [&](size_t i)
+    {
+        return builder.CreateConstInBoundsGEP2_64(entry_type->getElementType(2), keys_ptr, 0, i);
+    };
+
+    lock(lock_ptr, "memolock");
+    Value *hit = builder.CreateICmpNE(builder.CreateLoad(i32, valid_ptr), builder.getInt32(0));
+    for (size_t i = 0; i < arity; i++)
+    {
+        hit = builder.CreateAnd(hit, builder.CreateICmpEQ(builder.CreateLoad(i64, keyPtr(i)), keys[i]));
+    }
+    Value *cached = builder.CreateLoad(i64, result_ptr, "memoval");
+    unlock(lock_ptr);
+    BasicBlock *found = BasicBlock::Create(llvmContext, "memohit", func);
+    BasicBlock *missed = BasicBlock::Create(llvmContext, "memomiss", func);
+    builder.CreateCondBr(hit, found, missed);
+    builder.SetInsertPoint(found);
+    builder.CreateRet(fromBits(cached, func->getReturnType()));
+
+    // 计算时不持有锁, 函数体中的递归调用可能用到同一项
+    builder.SetInsertPoint(missed);
+    Value *result = builder.CreateCall(compute, args, "memores");
+    Value *result_bits = toBits(result);
+    lock(lock_ptr, "memofill");
+    for (size_t i = 0; i < arity; i++)
+    {
+        builder.CreateStore(keys[i], keyPtr(i));
+    }
+    builder.CreateStore(result_bits, result_ptr);
+    builder.CreateStore(builder.getInt32(1), valid_ptr);
+    unlock(lock_ptr);
+    builder.CreateRet(result);
+}
+
+void FunctionAST::emitProfileCounters(ASTContext &context, Function *func, bool countCalls) const
+{
+    IRBuilder<> builder(context.llvmContext);
+    Type *int_type = builder.getInt64Ty();
+    ArrayType *counters_type = ArrayType::get(int_type, 2);
+    // 外部符号, 由JIT解析为FunctionProfiler中这个函数的计数器
+    Constant *counters = context.module->getOrInsertGlobal(
+        (FunctionProfiler::kSymbolPrefix + g_symbols.name(proto_->name())).str(), counters_type);
+    Function *cycle_counter = Intrinsic::getDeclaration(context.module.get(), Intrinsic::readcyclecounter);
+    auto add = [&](unsigned index, Value *value)
+    {
+        builder.CreateAtomicRMW(AtomicRMWInst::Add, builder.CreateConstInBoundsGEP2_32(counters_type, counters, 0, index),
+                                value, Align(8), AtomicOrdering::Monotonic);
+    };
+
+    // 调用函数定义的时间计入被调函数自身, extern(比如libm)的时间计入调用者
+    SmallVector<CallInst *, 8> calls;
+    SmallVector<ReturnInst *, 4> returns;
+    for (BasicBlock &block : *func)
+    {
+        for (Instruction &inst : block)
+        {
+            if (auto *call = dyn_cast<CallInst>(&inst))
+            {
+                Function *callee = call->getCalledFunction();
+                if (callee == nullptr || callee->isIntrinsic())
+                {
+                    continue;
+                }
+                // 在编译线程中执行, 只能查找不能intern; 不是源码中的名字(比如name.memo)时也是函数定义
+                Optional<Symbol> symbol = g_symbols.find(callee->getName());
+                if (!symbol || !context.functionProtos->isExtern(*symbol))
+                {
+                    calls.push_back(call);
+                }
+            }
+            else if (auto *ret = dyn_cast<ReturnInst>(&inst))
+            {
+                returns.push_back(ret);
+            }
+        }
+    }
+
+    BasicBlock &entry = func->getEntryBlock();
+    builder.SetInsertPoint(&entry, entry.getFirstInsertionPt());
+    AllocaInst *callee_cycles = nullptr;
+    if (!calls.empty())
+    {
+        callee_cycles = builder.CreateAlloca(int_type, nullptr, "prof.callee");
+        builder.CreateStore(builder.getInt64(0), callee_cycles);
+    }
+    if (countCalls)
+    {
+        add(0, builder.getInt64(1));
+    }
+    Value *start = builder.CreateCall(cycle_counter, {}, "prof.start");
+    for (CallInst *call : calls)
+    {
+        builder.SetInsertPoint(call);
+        Value *before = builder.CreateCall(cycle_counter, {}, "prof.before");
+        builder.SetInsertPoint(call->getNextNode());
+        Value *elapsed = builder.CreateSub(builder.CreateCall(cycle_counter, {}, "prof.after"), before);
+        builder.CreateStore(builder.CreateAdd(builder.CreateLoad(int_type, callee_cycles), elapsed), callee_cycles);
+    }
+    for (ReturnInst *ret : returns)
+    {
+        builder.SetInsertPoint(ret);
+        Value *elapsed = builder.CreateSub(builder.CreateCall(cycle_counter, {}, "prof.end"), start);
+        if (callee_cycles != nullptr)
+        {
+            elapsed = builder.CreateSub(elapsed, builder.CreateLoad(int_type, callee_cycles));
+        }
+        add(1, elapsed);
+    }
+}
+
+AllocaInst *ASTContext::createEntryBlockAlloca(Symbol name, Type *type)
+{
+    Function *func = irBuilder.GetInsertBlock()->getParent();
+    IRBuilder<> entry(&func->getEntryBlock(), func->getEntryBlock().begin());
+    return entry.CreateAlloca(type, nullptr, g_symbols.name(name));
+}
+
+Value *emitVariable(ASTContext &context, Symbol name)
+{
+    AllocaInst *alloca = context.namedValue(name);
+    if (alloca == nullptr)
+    {
+        return LogErrorV("unknown variable name");
+    }
+    IRBuilder<> &builder = context.irBuilder;
+    ElementLoop *loop = context.elementLoop;
+    if (loop == nullptr || !alloca->getAllocatedType()->isPointerTy())
+    {
+        return builder.CreateLoad(alloca->getAllocatedType(), alloca, g_symbols.name(name));
+    }
+    // 逐元素循环中数组变量的值是当前下标处的元素。循环体中只能得到元素,
+    // 不能给数组变量赋值, 所以可以在preheader中读取变量
+    IRBuilder<> preheader(loop->preheader->getTerminator());
+    Value *array = preheader.CreateLoad(alloca->getAllocatedType(), alloca, g_symbols.name(name));
+    Value *element = builder.CreateInBoundsGEP(builder.getDoubleTy(), loop->bind(array), loop->index);
+    return builder.CreateLoad(builder.getDoubleTy(), element, g_symbols.name(name));
+}
+
+Value *ElementLoop::bind(Value *array)
+{
+    // 数组的指针和长度在循环中不变, 在preheader中读取一次
+    IRBuilder<> builder(preheader->getTerminator());
+    Type *array_type = kalArrayType(builder.getContext());
+    Value *data = builder.CreateLoad(Type::getDoublePtrTy(builder.getContext()), builder.CreateStructGEP(array_type, array, 0), "data");
+    Value *len = builder.CreateLoad(builder.getInt64Ty(), builder.CreateStructGEP(array_type, array, 1), "len");
+    length = length ? builder.CreateSelect(builder.CreateICmpSLT(length, len), length, len, "len") : len;
+    return data;
+}
+
+Value *emitAssignment(ASTContext &context, Symbol name, Value *value)
+{
+    if (value == nullptr)
+    {
+        return nullptr;
+    }
+    AllocaInst *alloca = context.namedValue(name);
+    if (alloca == nullptr)
+    {
+        return LogErrorV("unknown variable name");
+    }
+    // 变量的类型在定义时确定, 赋值时转换为变量的类型
+    value = convertValue(context.irBuilder, value, alloca->getAllocatedType());
+    if (value == nullptr)
+    {
+        return nullptr;
+    }
+    context.irBuilder.CreateStore(value, alloca);
+    // 赋值表达式的值就是赋的值
+    return value;
+}
+
+Value *emitVarExpr(ASTContext &context, ArrayRef<Symbol> names, ArrayRef<ValueType> types,
+                   function_ref<Value *(size_t)> init, function_ref<Value *()> body)
+{
+    // 新变量可能覆盖外层的同名变量, 结束后恢复
+    SmallVector<AllocaInst *, 4> old_values;
+    auto restore = [&]()
+    {
+        for (size_t i = 0; i < old_values.size(); i++)
+        {
+            context.namedValue(names[i], old_values[i]);
+        }
+    };
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        // 先求初始值再定义变量, var a = a 中右边的a是外层的变量
+        Value *init_val = init(i);
+        Type *type = nullptr;
+        if (init_val != nullptr)
+        {
+            type = types[i] == TYPE_AUTO ? init_val->getType() : context.llvmType(types[i]);
+            init_val = convertValue(context.irBuilder, init_val, type);
+        }
+        if (init_val == nullptr)
+        {
+            restore();
+            return nullptr;
+        }
+        AllocaInst *alloca = context.createEntryBlockAlloca(names[i], type);
+        context.irBuilder.CreateStore(init_val, alloca);
+        old_values.push_back(context.namedValue(names[i]));
+        context.namedValue(names[i], alloca);
+    }
+    Value *body_val = body();
+    restore();
+    return body_val;
+}
+
+Value *emitIfExpr(ASTContext &context, function_ref<Value *()> cond,
+                  function_ref<Value *()> then, function_ref<Value *()> otherwise)
+{
+    Value *cond_val = cond();
+    if (cond_val == nullptr)
+    {
+        return nullptr;
+    }
+    IRBuilder<> &builder = context.irBuilder;
+    cond_val = convertValue(builder, cond_val, builder.getInt1Ty());
+    if (cond_val == nullptr)
+    {
+        return nullptr;
+    }
+    // block一开始就放进函数, 出错时随函数一起删除
+    Function *func = builder.GetInsertBlock()->getParent();
+    BasicBlock *then_block = BasicBlock::Create(context.llvmContext, "then", func);
+    BasicBlock *else_block = BasicBlock::Create(context.llvmContext, "else", func);
+    BasicBlock *merge_block = BasicBlock::Create(context.llvmContext, "ifcont", func);
+    builder.CreateCondBr(cond_val, then_block, else_block);
+
+    builder.SetInsertPoint(then_block);
+    Value *then_val = then();
+    if (then_val == nullptr)
+    {
+        return nullptr;
+    }
+    builder.CreateBr(merge_block);
+    // then的codegen可能追加了新的block(嵌套的if), PHI的来源是当前所在的block
+    then_block = builder.GetInsertBlock();
+
+    else_block->moveAfter(then_block);
+    builder.SetInsertPoint(else_block);
+    Value *else_val = otherwise();
+    if (else_val == nullptr)
+    {
+        return nullptr;
+    }
+    builder.CreateBr(merge_block);
+    else_block = builder.GetInsertBlock();
+
+    // 两个分支的类型不同时合并为double(有一边是double)或i64, 在各自的跳转之前转换
+    Type *type = then_val->getType();
+    if (else_val->getType() != type)
+    {
+        type = type->isDoubleTy() || else_val->getType()->isDoubleTy() ? builder.getDoubleTy()
+                                                                       : builder.getInt64Ty();
+        builder.SetInsertPoint(then_block->getTerminator());
+        then_val = convertValue(builder, then_val, type);
+        builder.SetInsertPoint(else_block->getTerminator());
+        else_val = convertValue(builder, else_val, type);
+        if (then_val == nullptr || else_val == nullptr)
+        {
+            return nullptr;
+        }
+    }
+
+    merge_block->moveAfter(else_block);
+    builder.SetInsertPoint(merge_block);
+    PHINode *phi = builder.CreatePHI(type, 2, "iftmp");
+    phi->addIncoming(then_val, then_block);
+    phi->addIncoming(else_val, else_block);
+    return phi;
+}
+
+Value *emitForExpr(ASTContext &context, Symbol var, ValueType type, function_ref<Value *()> start,
+                   function_ref<Value *()> end, function_ref<Value *()> step,
+                   function_ref<Value *()> body)
+{
+    Value *start_val = start();
+    if (start_val == nullptr)
+    {
+        return nullptr;
+    }
+    if (start_val->getType()->isPointerTy())
+    {
+        return LogErrorV("for loop variable cannot be an array");
+    }
+    IRBuilder<> &builder = context.irBuilder;
+    Function *func = builder.GetInsertBlock()->getParent();
+    // 循环变量可能覆盖同名的变量, 结束后恢复
+    AllocaInst *old_val = context.namedValue(var);
+    // 循环变量至少是i64, bool的起始值没有意义
+    Type *var_type = context.llvmType(type);
+    if (var_type == nullptr)
+    {
+        var_type = start_val->getType()->isIntegerTy(1) ? builder.getInt64Ty() : start_val->getType();
+    }
+    if (var_type->isPointerTy())
+    {
+        return LogErrorV("for loop variable cannot be an array");
+    }
+    AllocaInst *alloca = context.createEntryBlockAlloca(var, var_type);
+    builder.CreateStore(convertValue(builder, start_val, var_type), alloca);
+    context.namedValue(var, alloca);
+    auto condition = [&]() -> Value *
+    {
+        Value *end_val = end();
+        return end_val ? convertValue(builder, end_val, builder.getInt1Ty()) : nullptr;
+    };
+
+    // 生成规范形式的循环: preheader中先检查一次条件, latch中计算下一个值并再次检查条件,
+    // 不需要LoopRotate就能交给循环优化。循环变量放在alloca中(body可以给它赋值),
+    // mem2reg之后循环头中就是归纳变量的PHI
+    Value *enter = condition();
+    if (enter == nullptr)
+    {
+        context.namedValue(var, old_val);
+        return nullptr;
+    }
+    // block一开始就放进函数, 出错时随函数一起删除
+    BasicBlock *loop_block = BasicBlock::Create(context.llvmContext, "loop", func);
+    BasicBlock *after_block = BasicBlock::Create(context.llvmContext, "afterloop", func);
+    builder.CreateCondBr(enter, loop_block, after_block);
+
+    builder.SetInsertPoint(loop_block);
+    Value *step_val = nullptr;
+    if (body() == nullptr || (step_val = step()) == nullptr)
+    {
+        context.namedValue(var, old_val);
+        return nullptr;
+    }
+    Value *cur_val = builder.CreateLoad(var_type, alloca, g_symbols.name(var));
+    step_val = convertValue(builder, step_val, var_type);
+    if (step_val == nullptr)
+    {
+        context.namedValue(var, old_val);
+        return nullptr;
+    }
+    builder.CreateStore(var_type->isDoubleTy() ? builder.CreateFAdd(cur_val, step_val, "nextvar")
+                                               : builder.CreateAdd(cur_val, step_val, "nextvar"),
+                        alloca);
+    Value *again = condition();
+    context.namedValue(var, old_val);
+    if (again == nullptr)
+    {
+        return nullptr;
+    }
+    // body可能追加了新的block, latch是当前所在的block
+    BasicBlock *latch = builder.GetInsertBlock();
+    builder.CreateCondBr(again, loop_block, after_block);
+
+    after_block->moveAfter(latch);
+    builder.SetInsertPoint(after_block);
+    return Constant::getNullValue(Type::getDoubleTy(context.llvmContext));
+}
+
+// 生成逐元素循环: 对数组的每个下标求element()(其中的数组变量读取为当前元素),
+// 并归约为和/最小值/最大值, 或者写入target数组的同一下标。
+// 归约使用允许重结合的浮点运算, 循环向量化可以把它变成SIMD循环
+static Value *emitElementwise(ASTContext &context, Builtin builtin, Value *target,
+                              function_ref<Value *()> element)
+{
+    IRBuilder<> &builder = context.irBuilder;
+    Function *func = builder.GetInsertBlock()->getParent();
+    Type *double_type = builder.getDoubleTy();
+    ElementLoop loop = {builder.GetInsertBlock(), nullptr, nullptr};
+    // block一开始就放进函数, 出错时随函数一起删除
+    BasicBlock *body = BasicBlock::Create(context.llvmContext, "elemloop", func);
+    BasicBlock *exit = BasicBlock::Create(context.llvmContext, "elemexit", func);
+    // 循环次数在生成循环体后才知道, 先用无条件跳转占位, bind()在它之前插入指令
+    BranchInst *enter = builder.CreateBr(body);
+    Value *target_data = target ? loop.bind(target) : nullptr;
+
+    // 与for循环一样生成规范形式的循环, 在preheader和latch中检查条件
+    builder.SetInsertPoint(body);
+    PHINode *index = builder.CreatePHI(builder.getInt64Ty(), 2, "i");
+    index->addIncoming(builder.getInt64(0), loop.preheader);
+    loop.index = index;
+    PHINode *acc = nullptr;
+    Constant *init = nullptr;
+    if (builtin != BUILTIN_STORE)
+    {
+        acc = builder.CreatePHI(double_type, 2, "acc");
+        init = ConstantFP::get(double_type, builtin == BUILTIN_SUM   ? 0.0
+                                            : builtin == BUILTIN_MIN ? HUGE_VAL
+                                                                     : -HUGE_VAL);
+        acc->addIncoming(init, loop.preheader);
+    }
+
+    ElementLoop *outer = context.elementLoop;
+    context.elementLoop = &loop;
+    Value *element_val = element();
+    context.elementLoop = outer;
+    if (element_val != nullptr)
+    {
+        element_val = convertValue(builder, element_val, double_type);
+    }
+    if (element_val == nullptr)
+    {
+        return nullptr;
+    }
+    if (loop.length == nullptr)
+    {
+        return LogErrorV("elementwise expression does not use any array");
+    }
+    Value *next_acc = nullptr;
+    // 在默认标志(--fast-math)的基础上允许重结合, 累加可以向量化
+    FastMathFlags defaults = builder.getFastMathFlags();
+    FastMathFlags flags = defaults;
+    flags.setAllowReassoc();
+    flags.setNoNaNs();
+    flags.setNoSignedZeros();
+    IRBuilder<>::FastMathFlagGuard guard(builder);
+    builder.setFastMathFlags(flags);
+    switch (builtin)
+    {
+    case BUILTIN_SUM:
+        next_acc = builder.CreateFAdd(acc, element_val, "sum");
+        break;
+    case BUILTIN_MIN:
+        next_acc = builder.CreateSelect(builder.CreateFCmpOLT(element_val, acc), element_val, acc, "min");
+        break;
+    case BUILTIN_MAX:
+        next_acc = builder.CreateSelect(builder.CreateFCmpOGT(element_val, acc), element_val, acc, "max");
+        break;
+    default:
+        builder.CreateStore(element_val, builder.CreateInBoundsGEP(double_type, target_data, index));
+        break;
+    }
+    builder.setFastMathFlags(defaults);
+    Value *next_index = builder.CreateAdd(index, builder.getInt64(1), "nexti", true, true);
+    // 参数的codegen可能追加了新的block, latch是当前所在的block
+    BasicBlock *latch = builder.GetInsertBlock();
+    builder.CreateCondBr(builder.CreateICmpSLT(next_index, loop.length, "elemcond"), body, exit);
+    index->addIncoming(next_index, latch);
+
+    builder.SetInsertPoint(enter);
+    builder.CreateCondBr(builder.CreateICmpSGT(loop.length, builder.getInt64(0), "elemcond"), body, exit);
+    enter->eraseFromParent();
+
+    exit->moveAfter(latch);
+    builder.SetInsertPoint(exit);
+    if (acc == nullptr)
+    {
+        return ConstantFP::get(double_type, 0.0);
+    }
+    acc->addIncoming(next_acc, latch);
+    PHINode *result = builder.CreatePHI(double_type, 2, "reduce");
+    result->addIncoming(init, loop.preheader);
+    result->addIncoming(next_acc, latch);
+    return result;
+}
+
+Value *emitCallExpr(ASTContext &context, Symbol callee, size_t count,
+                    function_ref<Value *(size_t)> arg)
+{
+    if (g_symbols.isBuiltin(callee))
+    {
+        Builtin builtin = (Builtin)(callee - g_keyword_count);
+        size_t arity = builtin == BUILTIN_STORE ? 2 : 1;
+        if (count != arity)
+        {
+            return LogErrorV("incorrect # arguments passed");
+        }
+        // len和store的数组参数在逐元素循环之外求值, 得到的是数组本身
+        Value *array = nullptr;
+        if (builtin == BUILTIN_LEN || builtin == BUILTIN_STORE)
+        {
+            ElementLoop *outer = context.elementLoop;
+            context.elementLoop = nullptr;
+            array = arg(0);
+            context.elementLoop = outer;
+            if (array == nullptr)
+            {
+                return nullptr;
+            }
+            if (!array->getType()->isPointerTy())
+            {
+                return LogErrorV("expected an array argument");
+            }
+        }
+        if (builtin == BUILTIN_LEN)
+        {
+            IRBuilder<> &builder = context.irBuilder;
+            Type *array_type = kalArrayType(context.llvmContext);
+            return builder.CreateLoad(builder.getInt64Ty(), builder.CreateStructGEP(array_type, array, 1), "len");
+        }
+        return emitElementwise(context, builtin, array, [&]()
+                               { return arg(arity - 1); });
+    }
+
+    Function *func = nullptr;
+    Intrinsic::ID id = context.functionProtos->intrinsic(callee);
+    if (id != Intrinsic::not_intrinsic)
+    {
+        func = Intrinsic::getDeclaration(context.module.get(), id, {context.irBuilder.getDoubleTy()});
+    }
+    else
+    {
+        func = context.getFunction(callee);
+    }
+    if (func == nullptr)
+    {
+        return LogErrorV("unknown function referenced");
+    }
+    if (func->arg_size() != count)
+    {
+        return LogErrorV("incorrect # arguments passed");
+    }
+    SmallVector<Value *, 8> args;
+    for (size_t i = 0; i < count; i++)
+    {
+        Value *arg_val = arg(i);
+        if (arg_val != nullptr)
+        {
+            arg_val = convertValue(context.irBuilder, arg_val, func->getArg(i)->getType());
+        }
+        if (arg_val == nullptr)
+        {
+            return nullptr;
+        }
+        args.push_back(arg_val);
+    }
+    return context.irBuilder.CreateCall(func, args, "calltmp");
+}
+
+Value *ASTContext::pureValue(const ExprAST *expr, function_ref<Value *()> emit)
+{
+    if (pureValues == nullptr)
+    {
+        // 单独的字面值或变量不值得建表
+        if (!isa<BinaryExprAST>(expr))
+        {
+            return emit();
+        }
+        DenseMap<const ExprAST *, Value *> values;
+        pureValues = &values;
+        Value *value = emit();
+        pureValues = nullptr;
+        return value;
+    }
+    auto it = pureValues->find(expr);
+    if (it != pureValues->end())
+    {
+        return it->second;
+    }
+    Value *value = emit();
+    if (value != nullptr)
+    {
+        pureValues->insert({expr, value});
+    }
+    return value;
+}
+
+Function *ASTContext::getFunction(Symbol name)
+{
+    if (Function *func = module->getFunction(g_symbols.name(name)))
+    {
+        return func;
+    }
+    return functionProtos->declare(name, *this);
+}
+
+void PrototypeTable::add(const PrototypeAST &proto)
+{
+    lock_guard<mutex> lock(lock_);
+    protos_[proto.name()] = make_unique<PrototypeAST>(proto);
+    mathFunctions_.erase(proto.name());
+    externs_.erase(proto.name());
+}
+
+// libm中的纯数学函数, 有对应intrinsic时id为该intrinsic, 否则(比如atan2)为Intrinsic::not_intrinsic,
+// 仍然调用libm
+static bool lookupMathFunction(StringRef name, size_t arity, Intrinsic::ID &id)
+{
+    struct MathFunction
+    {
+        const char *name;
+        size_t arity;
+        Intrinsic::ID id;
+    };
+    static const MathFunction functions[] = {
+        {"sqrt", 1, Intrinsic::sqrt},
+        {"sin", 1, Intrinsic::sin},
+        {"cos", 1, Intrinsic::cos},
+        {"exp", 1, Intrinsic::exp},
+        {"exp2", 1, Intrinsic::exp2},
+        {"log", 1, Intrinsic::log},
+        {"log2", 1, Intrinsic::log2},
+        {"log10", 1, Intrinsic::log10},
+        {"fabs", 1, Intrinsic::fabs},
+        {"floor", 1, Intrinsic::floor},
+        {"ceil", 1, Intrinsic::ceil},
+        {"trunc", 1, Intrinsic::trunc},
+        {"round", 1, Intrinsic::round},
+        {"rint", 1, Intrinsic::rint},
+        {"nearbyint", 1, Intrinsic::nearbyint},
+        {"pow", 2, Intrinsic::pow},
+        {"copysign", 2, Intrinsic::copysign},
+        {"fmin", 2, Intrinsic::minnum},
+        {"fmax", 2, Intrinsic::maxnum},
+        {"fma", 3, Intrinsic::fma},
+        {"tan", 1, Intrinsic::not_intrinsic},
+        {"asin", 1, Intrinsic::not_intrinsic},
+        {"acos", 1, Intrinsic::not_intrinsic},
+        {"atan", 1, Intrinsic::not_intrinsic},
+        {"sinh", 1, Intrinsic::not_intrinsic},
+        {"cosh", 1, Intrinsic::not_intrinsic},
+        {"tanh", 1, Intrinsic::not_intrinsic},
+        {"cbrt", 1, Intrinsic::not_intrinsic},
+        {"expm1", 1, Intrinsic::not_intrinsic},
+        {"log1p", 1, Intrinsic::not_intrinsic},
+        {"atan2", 2, Intrinsic::not_intrinsic},
+        {"hypot", 2, Intrinsic::not_intrinsic},
+        {"fmod", 2, Intrinsic::not_intrinsic},
+    };
+    for (const MathFunction &func : functions)
+    {
+        if (name == func.name && arity == func.arity)
+        {
+            id = func.id;
+            return true;
+        }
+    }
+    return false;
+}
+
+void PrototypeTable::addExtern(const PrototypeAST &proto)
+{
+    bool all_double = proto.returnType() == TYPE_DOUBLE;
+    for (ValueType type : proto.argTypes())
+    {
+        all_double = all_double && type == TYPE_DOUBLE;
+    }
+    Intrinsic::ID id = Intrinsic::not_intrinsic;
+    bool math = all_double && lookupMathFunction(g_symbols.name(proto.name()), proto.args().size(), id);
+    lock_guard<mutex> lock(lock_);
+    protos_[proto.name()] = make_unique<PrototypeAST>(proto);
+    externs_.insert(proto.name());
+    if (math)
+    {
+        mathFunctions_[proto.name()] = id;
+    }
+    else
+    {
+        mathFunctions_.erase(proto.name());
+    }
+}
+
+bool PrototypeTable::define(const PrototypeAST &proto)
+{
+    lock_guard<mutex> lock(lock_);
+    auto &slot = protos_[proto.name()];
+    if (slot != nullptr)
+    {
+        if (slot->args().size() != proto.args().size())
+        {
+            LogError("redefinition of function with different # args");
+            return false;
+        }
+        if (slot->argTypes() != proto.argTypes())
+        {
+            LogError("redefinition of function with different argument types");
+            return false;
+        }
+        if (slot->returnType() != proto.returnType())
+        {
+            LogError("redefinition of function with different return type");
+            return false;
+        }
+    }
+    slot = make_unique<PrototypeAST>(proto);
+    // 定义了同名函数, 之后的调用不再替换为intrinsic
+    mathFunctions_.erase(proto.name());
+    externs_.erase(proto.name());
+    return true;
+}
+
+Optional<PrototypeAST> PrototypeTable::find(Symbol name) const
+{
+    lock_guard<mutex> lock(lock_);
+    auto it = protos_.find(name);
+    if (it != protos_.end())
+    {
+        return *it->second;
+    }
+    return None;
+}
+
+Intrinsic::ID PrototypeTable::intrinsic(Symbol name) const
+{
+    lock_guard<mutex> lock(lock_);
+    auto it = mathFunctions_.find(name);
+    return it != mathFunctions_.end() ? it->second : Intrinsic::not_intrinsic;
+}
+
+bool PrototypeTable::isMathFunction(Symbol name) const
+{
+    lock_guard<mutex> lock(lock_);
+    return mathFunctions_.count(name) != 0;
+}
+
+bool PrototypeTable::isExtern(Symbol name) const
+{
+    lock_guard<mutex> lock(lock_);
+    return externs_.count(name) != 0;
+}
+
+Function *PrototypeTable::declare(Symbol name, ASTContext &context) const
+{
+    lock_guard<mutex> lock(lock_);
+    auto it = protos_.find(name);
+    if (it != protos_.end())
+    {
+        return it->second->CodeGen(context);
+    }
+    return nullptr;
+}
+
+//
+
+unique_ptr<ASTArena> Parser::takeArena()
+{
+    auto result = move(arena);
+    arena = make_unique<ASTArena>();
+    numbers.clear();
+    variables.clear();
+    binaries.clear();
+    return result;
+}
+
+ExprAST *Parser::makeNumber(double val)
+{
+    if (!g_simplify_ast)
+    {
+        return arena->make<NumberExprAST>(val);
+    }
+    ExprAST *&node = numbers[DoubleToBits(val)];
+    if (node == nullptr)
+    {
+        node = arena->make<NumberExprAST>(val);
+    }
+    return node;
+}
+
+ExprAST *Parser::makeVariable(Symbol name)
+{
+    if (!g_simplify_ast)
+    {
+        return arena->make<VariableExprAST>(name);
+    }
+    ExprAST *&node = variables[name];
+    if (node == nullptr)
+    {
+        node = arena->make<VariableExprAST>(name);
+    }
+    return node;
+}
+
+// 结果一定是double或int的表达式, 不会是bool或array。
+// 字面值与int运算时按整数处理(见emitBinaryOp), 所以x*1对int和double都是x
+static bool isArithmetic(const ExprAST *expr)
+{
+    if (isa<NumberExprAST>(expr))
+    {
+        return true;
+    }
+    auto *binary = dyn_cast<BinaryExprAST>(expr);
+    return binary != nullptr && StringRef("+-*").contains(binary->op());
+}
+
+ExprAST *Parser::makeBinary(char op, ExprAST *lhs, ExprAST *rhs)
+{
+    if (!g_simplify_ast)
+    {
+        return arena->make<BinaryExprAST>(op, lhs, rhs);
+    }
+    auto *lhs_num = dyn_cast<NumberExprAST>(lhs);
+    auto *rhs_num = dyn_cast<NumberExprAST>(rhs);
+    // 与IRBuilder对两个double常量的折叠结果相同; '<'的结果是bool, 字面值无法表示, 不折叠
+    if (lhs_num != nullptr && rhs_num != nullptr)
+    {
+        switch (op)
+        {
+        case '+':
+            return makeNumber(lhs_num->val() + rhs_num->val());
+        case '-':
+            return makeNumber(lhs_num->val() - rhs_num->val());
+        case '*':
+            return makeNumber(lhs_num->val() * rhs_num->val());
+        }
+    }
+    auto isNumber = [](NumberExprAST *num, double val)
+    {
+        return num != nullptr && DoubleToBits(num->val()) == DoubleToBits(val);
+    };
+    switch (op)
+    {
+    case '*':
+        if (isNumber(rhs_num, 1.0) && isArithmetic(lhs))
+        {
+            return lhs;
+        }
+        if (isNumber(lhs_num, 1.0) && isArithmetic(rhs))
+        {
+            return rhs;
+        }
+        break;
+    case '-':
+        // x - 0.0对-0.0也是x
+        if (isNumber(rhs_num, 0.0) && isArithmetic(lhs))
+        {
+            return lhs;
+        }
+        break;
+    case '+':
+        // -0.0 + 0.0是0.0, 忽略零的符号(--fast-math)时才能化简x + 0.0
+        if ((isNumber(rhs_num, -0.0) || (g_fast_math && isNumber(rhs_num, 0.0))) && isArithmetic(lhs))
+        {
+            return lhs;
+        }
+        if ((isNumber(lhs_num, -0.0) || (g_fast_math && isNumber(lhs_num, 0.0))) && isArithmetic(rhs))
+        {
+            return rhs;
+        }
+        break;
+    case ':':
+        // 字面值没有副作用
+        if (lhs_num != nullptr)
+        {
+            return rhs;
+        }
+        break;
+    }
+    if (!lhs->pure() || !rhs->pure() || !StringRef("+-*<").contains(op))
+    {
+        return arena->make<BinaryExprAST>(op, lhs, rhs);
+    }
+    ExprAST *&node = binaries[std::make_tuple(op, lhs, rhs)];
+    if (node == nullptr)
+    {
+        node = arena->make<BinaryExprAST>(op, lhs, rhs);
+    }
+    return node;
+}
+
+StringRef Parser::identifier()
+{
+    return g_symbols.name(g_identifier_sym);
+}
+
+double Parser::number()
+{
+    return g_number_val;
+}
+
+StringRef Parser::tokenText()
+{
+    return StringRef(stream->data() + token_offset, token_length);
+}
+
+int Parser::nextChar()
+{
+    if (pos == stream->size() && !stream->fill())
+    {
+        return last_char = EOF;
+    }
+    return last_char = (unsigned char)stream->data()[pos++];
+}
+
+int Parser::GetToken()
+{
+    // 忽略空白字符
+    while (isspace(last_char))
+    {
+        nextChar();
+    }
+    token_offset = last_char == EOF ? pos : pos - 1;
+    token_length = last_char == EOF ? 0 : 1;
+    // 识别字符串
+    if (isalpha(last_char))
+    {
+        while (isalnum((nextChar())))
+        {
+        }
+        token_length = (last_char == EOF ? pos : pos - 1) - token_offset;
+        // 驻留到符号表, 一次查找同时完成关键字识别
+        g_identifier_sym = g_symbols.intern(tokenText());
+        if (g_symbols.isKeyword(g_identifier_sym))
+        {
+            return g_keywords[g_identifier_sym].second;
+        }
+        return TOKEN_IDENTIFIER;
+    }
+    // 识别数值
+    if (isdigit(last_char) || last_char == '.')
+    {
+        do
+        {
+            nextChar();
+        } while (isdigit(last_char) || last_char == '.');
+        token_length = (last_char == EOF ? pos : pos - 1) - token_offset;
+        // 输入缓冲区不以'\0'结尾，复制出来再转换
+        string num_str = tokenText().str();
+        g_number_val = strtod(num_str.c_str(), nullptr);
+        return TOKEN_NUMBER;
+    }
+    // 忽略注释
+    if (last_char == '#')
+    {
+        do
+        {
+            nextChar();
+        } while (last_char != EOF && last_char != '\n' && last_char != '\r');
+        if (last_char != EOF)
+        {
+            return GetToken();
+        }
+    }
+    // 识别文件结束
+    if (last_char == EOF)
+    {
+        return TOKEN_EOF;
+    }
+    // 直接返回ASCII
+    int this_char = last_char;
+    if (this_char == ';')
+    {
+        // ';'结束一个item, 之后不预读字符, 交互输入时不用等待下一行
+        last_char = ' ';
+    }
+    else
+    {
+        nextChar();
+    }
+    return this_char;
+}
+
+void Parser::releaseInput()
+{
+    size_t released = stream->discard(token_offset);
+    pos -= released;
+    token_offset -= released;
+}
+
+int Parser::GetNextToken()
+{
+    PhaseScope scope(PHASE_LEX);
+    return g_current_token = GetToken();
+}
+int Parser::currentToken()
+{
+    return g_current_token;
+}
+
+int Parser::GetTokenPrecedence()
+{
+    return g_binop_precedence.get(g_current_token);
+}
+
+ExprAST *Parser::ParseNumberExpr()
+{
+    auto result = makeNumber(g_number_val);
+    GetNextToken();
+    return result;
+}
+
+// parenexpr ::= ( expression )
+ExprAST *Parser::ParseParenExpr()
+{
+    GetNextToken(); // eat (
+    auto expr = ParseExpression();
+    if (expr == nullptr)
+    {
+        return nullptr;
+    }
+    if (g_current_token != ')')
+    {
+        return LogError("expected ')'");
+    }
+    GetNextToken(); // eat )
+    return expr;
+}
+
+/// identifierexpr
+///   ::= identifier
+///   ::= identifier ( expression, expression, ..., expression )
+ExprAST *Parser::ParseIdentifierExpr()
+{
+    Symbol id = g_identifier_sym;
+    GetNextToken();
+    if (g_current_token != '(')
+    {
+        return makeVariable(id);
+    }
+    else
+    {
+        GetNextToken(); // eat (
+        SmallVector<ExprAST *, 8> args;
+        while (g_current_token != ')')
+        {
+            auto arg = ParseExpression();
+            if (arg == nullptr)
+            {
+                return nullptr;
+            }
+            args.push_back(arg);
+            if (g_current_token == ')')
+            {
+                break;
+            }
+            else if (g_current_token != ',')
+            {
+                return LogError("expected ')' or ',' in argument list");
+            }
+            else
+            {
+                GetNextToken(); // eat ,
+            }
+        }
+        GetNextToken(); // eat )
+        return arena->make<CallExprAST>(id, arena->copy<ExprAST *>(args));
+    }
+}
+
+// ifexpr ::= if expression then expression else expression
+ExprAST *Parser::ParseIfExpr()
+{
+    GetNextToken(); // eat if
+    auto cond = ParseExpression();
+    if (cond == nullptr)
+    {
+        return nullptr;
+    }
+    if (g_current_token != TOKEN_THEN)
+    {
+        return LogError("expected then");
+    }
+    GetNextToken(); // eat then
+    auto then = ParseExpression();
+    if (then == nullptr)
+    {
+        return nullptr;
+    }
+    if (g_current_token != TOKEN_ELSE)
+    {
+        return LogError("expected else");
+    }
+    GetNextToken(); // eat else
+    auto otherwise = ParseExpression();
+    if (otherwise == nullptr)
+    {
+        return nullptr;
+    }
+    return arena->make<IfExprAST>(cond, then, otherwise);
+}
+
+// type ::= ':' (double | int | bool | array)
+bool Parser::ParseTypeAnnotation(ValueType &type)
+{
+    GetNextToken(); // eat :
+    if (g_current_token != TOKEN_IDENTIFIER)
+    {
+        LogError("expected type name after ':'");
+        return false;
+    }
+    StringRef name = g_symbols.name(g_identifier_sym);
+    if (name == "double")
+    {
+        type = TYPE_DOUBLE;
+    }
+    else if (name == "int")
+    {
+        type = TYPE_INT;
+    }
+    else if (name == "bool")
+    {
+        type = TYPE_BOOL;
+    }
+    else if (name == "array")
+    {
+        type = TYPE_ARRAY;
+    }
+    else
+    {
+        LogError("unknown type name");
+        return false;
+    }
+    GetNextToken(); // eat type name
+    return true;
+}
+
+// forexpr ::= for identifier [type] = expression, expression [, expression] in expression
+ExprAST *Parser::ParseForExpr()
+{
+    GetNextToken(); // eat for
+    if (g_current_token != TOKEN_IDENTIFIER)
+    {
+        return LogError("expected identifier after for");
+    }
+    Symbol var = g_identifier_sym;
+    GetNextToken(); // eat identifier
+    ValueType type = TYPE_AUTO;
+    if (g_current_token == ':' && !ParseTypeAnnotation(type))
+    {
+        return nullptr;
+    }
+    if (g_current_token != '=')
+    {
+        return LogError("expected '=' after for");
+    }
+    GetNextToken(); // eat =
+    auto start = ParseExpression();
+    if (start == nullptr)
+    {
+        return nullptr;
+    }
+    if (g_current_token != ',')
+    {
+        return LogError("expected ',' after for start value");
+    }
+    GetNextToken(); // eat ,
+    auto end = ParseExpression();
+    if (end == nullptr)
+    {
+        return nullptr;
+    }
+    // 步长可以省略
+    ExprAST *step;
+    if (g_current_token == ',')
+    {
+        GetNextToken(); // eat ,
+        step = ParseExpression();
+        if (step == nullptr)
+        {
+            return nullptr;
+        }
+    }
+    else
+    {
+        step = arena->make<NumberExprAST>(1.0);
+    }
+    if (g_current_token != TOKEN_IN)
+    {
+        return LogError("expected 'in' after for");
+    }
+    GetNextToken(); // eat in
+    auto body = ParseExpression();
+    if (body == nullptr)
+    {
+        return nullptr;
+    }
+    return arena->make<ForExprAST>(var, type, start, end, step, body);
+}
+
+// varexpr ::= var identifier [type] [= expression] [, identifier [type] [= expression]]... in expression
+ExprAST *Parser::ParseVarExpr()
+{
+    GetNextToken(); // eat var
+    SmallVector<Symbol, 4> names;
+    SmallVector<ValueType, 4> types;
+    SmallVector<ExprAST *, 4> inits;
+    if (g_current_token != TOKEN_IDENTIFIER)
+    {
+        return LogError("expected identifier after var");
+    }
+    while (true)
+    {
+        names.push_back(g_identifier_sym);
+        GetNextToken(); // eat identifier
+        ValueType type = TYPE_AUTO;
+        if (g_current_token == ':' && !ParseTypeAnnotation(type))
+        {
+            return nullptr;
+        }
+        types.push_back(type);
+        // 初始值可以省略
+        ExprAST *init;
+        if (g_current_token == '=')
+        {
+            GetNextToken(); // eat =
+            init = ParseExpression();
+            if (init == nullptr)
+            {
+                return nullptr;
+            }
+        }
+        else
+        {
+            init = arena->make<NumberExprAST>(0.0);
+        }
+        inits.push_back(init);
+        if (g_current_token != ',')
+        {
+            break;
+        }
+        GetNextToken(); // eat ,
+        if (g_current_token != TOKEN_IDENTIFIER)
+        {
+            return LogError("expected identifier list after var");
+        }
+    }
+    if (g_current_token != TOKEN_IN)
+    {
+        return LogError("expected 'in' keyword after 'var'");
+    }
+    GetNextToken(); // eat in
+    auto body = ParseExpression();
+    if (body == nullptr)
+    {
+        return nullptr;
+    }
+    return arena->make<VarExprAST>(arena->copy<Symbol>(names), arena->copy<ValueType>(types),
+                                   arena->copy<ExprAST *>(inits), body);
+}
+
+/// primary
+///   ::= identifierexpr
+///   ::= numberexpr
+///   ::= parenexpr
+///   ::= ifexpr
+///   ::= forexpr
+///   ::= varexpr
+ExprAST *Parser::ParsePrimary()
+{
+    switch (g_current_token)
+    {
+    case TOKEN_VAR:
+        return ParseVarExpr();
+    case TOKEN_IF:
+        return ParseIfExpr();
+    case TOKEN_FOR:
+        return ParseForExpr();
+    case TOKEN_IDENTIFIER:
+        return ParseIdentifierExpr();
+    case TOKEN_NUMBER:
+        return ParseNumberExpr();
+    case '(':
+        return ParseParenExpr();
+    default:
+        return LogError("unknown token when expecting an expression");
+    }
+}
+
+ExprAST *Parser::ParseBinOpRhs(
+    int min_precedence,
+    ExprAST *lhs)
+{
+    while (true)
+    {
+        int current_precedence = GetTokenPrecedence();
+        if (current_precedence < min_precedence)
+        {
+            // 如果当前token不是二元操作符，current_precedence为-1, 结束任务
+            // 如果遇到优先级更低的操作符，也结束任务
+            return lhs;
+        }
+        int binop = g_current_token;
+        TRACE_PARSE("binop: " << (char)binop);
+        GetNextToken(); // eat binop
+        auto rhs = ParsePrimary();
+        if (rhs == nullptr)
+        {
+            return nullptr;
+        }
+        // 现在我们有两种可能的解析方式
+        //    * (lhs binop rhs) binop unparsed
+        //    * lhs binop (rhs binop unparsed)
+        int next_precedence = GetTokenPrecedence();
+        if (current_precedence < next_precedence)
+        {
+            // 将高于current_precedence的右边的操作符处理掉返回
+            rhs = ParseBinOpRhs(current_precedence + 1, rhs);
+            if (rhs == nullptr)
+            {
+                return nullptr;
+            }
+        }
+        lhs = makeBinary(binop, lhs, rhs);
+        // 继续循环
+    }
+}
+
+// expression
+//   ::= primary [binop primary] [binop primary] ...
+ExprAST *Parser::ParseExpression()
+{
+    auto lhs = ParsePrimary();
+    if (lhs == nullptr)
+    {
+        return nullptr;
+    }
+    return ParseBinOpRhs(0, lhs);
+}
+
+// prototype
+//   ::= id ( id [type] id [type] ... id [type] ) [type]
+unique_ptr<PrototypeAST> Parser::ParsePrototype()
+{
+    if (g_current_token != TOKEN_IDENTIFIER)
+    {
+        LogError("expected function name in prototype");
+        return nullptr;
+    }
+    Symbol function_name = g_identifier_sym;
+    if (GetNextToken() != '(')
+    {
+        LogError("expected '(' in prototype");
+        return nullptr;
+    }
+    vector<Symbol> arg_names;
+    vector<ValueType> arg_types;
+    GetNextToken(); // eat (
+    while (g_current_token == TOKEN_IDENTIFIER)
+    {
+        arg_names.push_back(g_identifier_sym);
+        // 没有标注类型的参数是double
+        ValueType type = TYPE_DOUBLE;
+        if (GetNextToken() == ':' && !ParseTypeAnnotation(type))
+        {
+            return nullptr;
+        }
+        arg_types.push_back(type);
+    }
+    if (g_current_token != ')')
+    {
+        LogError("expected ')' in prototype");
+        return nullptr;
+    }
+    ValueType return_type = TYPE_DOUBLE;
+    if (GetNextToken() == ':' && !ParseTypeAnnotation(return_type)) // eat )
+    {
+        return nullptr;
+    }
+    return make_unique<PrototypeAST>(function_name, move(arg_names), move(arg_types), return_type);
+}
+
+// definition ::= memo? def prototype expression
+unique_ptr<FunctionAST> Parser::ParseDefinition()
+{
+    PhaseScope scope(PHASE_PARSE);
+    bool memoized = g_current_token == TOKEN_MEMO;
+    if (memoized)
+    {
+        GetNextToken(); // eat memo
+        if (g_current_token != TOKEN_DEF)
+        {
+            LogError("expected def after memo");
+            return nullptr;
+        }
+    }
+    GetNextToken(); // eat def
+    auto proto = ParsePrototype();
+    if (proto == nullptr)
+    {
+        return nullptr;
+    }
+    auto expr = ParseExpression();
+    if (expr == nullptr)
+    {
+        return nullptr;
+    }
+    auto func = make_unique<FunctionAST>(takeArena(), move(proto), expr);
+    func->setMemoized(memoized);
+    return func;
+}
+
+// external ::= extern prototype
+unique_ptr<PrototypeAST> Parser::ParseExtern()
+{
+    PhaseScope scope(PHASE_PARSE);
+    GetNextToken(); // eat extern
+    return ParsePrototype();
+}
+
+// toplevelexpr ::= expression
+unique_ptr<FunctionAST> Parser::ParseTopLevelExpr()
+{
+    PhaseScope scope(PHASE_PARSE);
+    auto expr = ParseExpression();
+    if (expr == nullptr)
+    {
+        return nullptr;
+    }
+    auto proto = make_unique<PrototypeAST>(g_symbols.intern(g_anon_expr_name), vector<Symbol>());
+    return make_unique<FunctionAST>(takeArena(), move(proto), expr);
+}
+
+TopLevelItem Parser::ParseItem()
+{
+    while (g_current_token == ';')
+    {
+        GetNextToken();
+    }
+    releaseInput();
+    TopLevelItem item;
+    switch (g_current_token)
+    {
+    case TOKEN_EOF:
+        item.kind = TopLevelItem::ITEM_EOF;
+        return item;
+    case TOKEN_DEF:
+    case TOKEN_MEMO:
+        item.kind = TopLevelItem::ITEM_DEFINITION;
+        item.func = ParseDefinition();
+        break;
+    case TOKEN_EXTERN:
+        item.kind = TopLevelItem::ITEM_EXTERN;
+        item.proto = ParseExtern();
+        break;
+    default:
+        item.kind = TopLevelItem::ITEM_EXPRESSION;
+        item.func = ParseTopLevelExpr();
+        break;
+    }
+    if (item.func == nullptr && item.proto == nullptr)
+    {
+        // 跳过出错的token继续解析
+        item.kind = TopLevelItem::ITEM_ERROR;
+        GetNextToken();
+    }
+    return item;
+}
+
+//
+
+PipelinedParser::PipelinedParser(Parser::CharStream *stream)
+    : parser(stream), worker([this]()
+                             { run(); })
+{
+}
+
+PipelinedParser::~PipelinedParser()
+{
+    worker.join();
+}
+
+void PipelinedParser::run()
+{
+    parser.GetNextToken();
+    while (true)
+    {
+        TopLevelItem item;
+        {
+            ErrorCapture capture;
+            item = parser.ParseItem();
+            item.errors = capture.takeMessages();
+        }
+        bool eof = item.kind == TopLevelItem::ITEM_EOF;
+        {
+            unique_lock<mutex> guard(lock);
+            space.wait(guard, [this]()
+                       { return items.size() < kMaxPending; });
+            items.push_back(move(item));
+        }
+        ready.notify_one();
+        if (eof)
+        {
+            return;
+        }
+    }
+}
+
+TopLevelItem PipelinedParser::next()
+{
+    TopLevelItem item;
+    {
+        unique_lock<mutex> guard(lock);
+        ready.wait(guard, [this]()
+                   { return !items.empty(); });
+        if (items.front().kind == TopLevelItem::ITEM_EOF)
+        {
+            // EOF留在队列中
+            return item;
+        }
+        item = move(items.front());
+        items.pop_front();
+    }
+    space.notify_one();
+    return item;
+}
+
+//
+
+FileCharStream::FileCharStream(const char *path)
+{
+    fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(path);
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED)
+        {
+            madvise(addr, st.st_size, MADV_SEQUENTIAL);
+            data_ = static_cast<const char *>(addr);
+            size_ = st.st_size;
+            mapped = true;
+        }
+    }
+}
+
+FileCharStream::~FileCharStream()
+{
+    if (mapped)
+    {
+        munmap(const_cast<char *>(data_), size_);
+    }
+    if (fd > STDIN_FILENO)
+    {
+        close(fd);
+    }
+}
+
+bool FileCharStream::fill()
+{
+    if (mapped || fd < 0)
+    {
+        return false;
+    }
+    size_t old_size = buffer.size();
+    buffer.resize(old_size + kBlockSize);
+    ssize_t n;
+    do
+    {
+        n = read(fd, buffer.data() + old_size, kBlockSize);
+    } while (n < 0 && errno == EINTR);
+    buffer.resize(old_size + (n > 0 ? n : 0));
+    data_ = buffer.data();
+    size_ = buffer.size();
+    return n > 0;
+}
+
+size_t FileCharStream::discard(size_t count)
+{
+    // mmap的文件不占用缓冲区; 攒够一块再丢弃, 移动的字节数与读入的总量成正比
+    if (mapped || count < kBlockSize)
+    {
+        return 0;
+    }
+    buffer.erase(buffer.begin(), buffer.begin() + count);
+    data_ = buffer.data();
+    size_ = buffer.size();
+    return count;
+}
+
+//
+
+ParallelCompiler::ParallelCompiler(KaleidoscopeJIT &jit, shared_ptr<PrototypeTable> functionProtos,
+                                   unsigned optLevel, unsigned threads, ObjectFileCache *cache)
+    : jit(jit), cache(cache), functionProtos(move(functionProtos)), dataLayout(jit.dataLayout()),
+      optLevel(optLevel), pool(hardware_concurrency(threads))
+{
+}
+
+ParallelCompiler::~ParallelCompiler()
+{
+    wait();
+}
+
+bool ParallelCompiler::add(unique_ptr<FunctionAST> func)
+{
+    if (!functionProtos->define(func->proto()))
+    {
+        return false;
+    }
+    pending.push_back(move(func));
+    if (pending.size() >= kBatchSize)
+    {
+        submit();
+    }
+    return true;
+}
+
+void ParallelCompiler::submit()
+{
+    if (pending.empty())
+    {
+        return;
+    }
+    // ThreadPool的任务必须可复制
+    auto batch = make_shared<vector<unique_ptr<FunctionAST>>>(move(pending));
+    pending.clear();
+    uint64_t sequence = submitted++;
+    pool.async([this, batch, sequence]()
+               {
+                   // 每个定义一个module(或缓存中的目标文件), 与串行编译相同, 可以单独重新定义
+                   struct Compiled
+                   {
+                       StringRef name;
+                       orc::ThreadSafeModule module;
+                       unique_ptr<MemoryBuffer> object;
+                   };
+                   vector<Compiled> compiled;
+                   {
+                       // context和targetMachine只在本线程中使用, 离开作用域之前不会交给JIT
+                       unique_ptr<TargetMachine> targetMachine;
+                       if (auto created = jit.createTargetMachine())
+                       {
+                           targetMachine = move(*created);
+                       }
+                       else
+                       {
+                           consumeError(created.takeError());
+                       }
+                       ASTContext context(dataLayout, optLevel, functionProtos, targetMachine.get());
+                       for (auto &func : *batch)
+                       {
+                           Compiled def;
+                           def.name = g_symbols.name(func->name());
+                           if (cache)
+                           {
+                               string key = func->cacheKey(jit.targetKey(), optLevel);
+                               def.object = cache->load(key);
+                               if (def.object)
+                               {
+                                   compiled.push_back(move(def));
+                                   continue;
+                               }
+                               // 第一次被调用时编译, 目标文件由ObjectFileCache::notifyObjectCompiled写入缓存
+                               context.module->setModuleIdentifier(key);
+                           }
+                           if (func->CodeGen(context) == nullptr)
+                           {
+                               context.resetModule();
+                               continue;
+                           }
+                           def.module = context.takeModule();
+                           compiled.push_back(move(def));
+                       }
+                   }
+                   batch->clear();
+
+                   // 按提交的顺序交给JIT, 同名的定义以源码中靠后的为准; 同时只有一批在修改桩
+                   unique_lock<mutex> lock(orderLock);
+                   orderChanged.wait(lock, [&]()
+                                     { return registered == sequence; });
+                   for (Compiled &def : compiled)
+                   {
+                       Error err = def.object ? jit.addDefinitionObject(def.name, move(def.object))
+                                              : jit.addDefinition(def.name, move(def.module));
+                       if (err)
+                       {
+                           fprintf(stderr, "Error: %s\n", toString(move(err)).c_str());
+                       }
+                   }
+                   registered++;
+                   orderChanged.notify_all(); });
+}
+
+void ParallelCompiler::wait()
+{
+    submit();
+    pool.wait();
+}
+
+Error addLazyDefinition(KaleidoscopeJIT &jit, unique_ptr<FunctionAST> func,
+                        shared_ptr<PrototypeTable> functionProtos, unsigned optLevel,
+                        ObjectFileCache *cache)
+{
+    if (!functionProtos->define(func->proto()))
+    {
+        // define已经报错, 之前的定义保持不变
+        return Error::success();
+    }
+    StringRef name = g_symbols.name(func->name());
+    DataLayout dataLayout = jit.dataLayout();
+    string key = cache ? func->cacheKey(jit.targetKey(), optLevel) : string();
+    return jit.addLazyFunction(
+        name, key, [&jit, func = move(func), functionProtos, dataLayout, optLevel, name, key]() mutable -> Expected<orc::ThreadSafeModule>
+        {
+            // 可能在JIT的编译线程中执行, 不能使用其他线程的TargetMachine
+            auto targetMachine = jit.createTargetMachine();
+            if (!targetMachine)
+            {
+                return targetMachine.takeError();
+            }
+            ASTContext context(dataLayout, optLevel, functionProtos, targetMachine->get());
+            if (!key.empty())
+            {
+                context.module->setModuleIdentifier(key);
+            }
+            if (func->CodeGen(context) == nullptr)
+            {
+                return make_error<StringError>("failed to generate function " + name, inconvertibleErrorCode());
+            }
+            return context.takeModule(); });
+}
@@ -0,0 +1,1448 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+using namespace std;
+
+#include "main.h"
+#include "aot.h"
+#include "jit.h"
+#include "profile.h"
+
+extern cl::OptionCategory g_kal_category;
+
+// 调试输出统一写入带64K缓冲的stderr, 不在每行之后flush
+raw_ostream &traceStream();
+
+// 解析过程的跟踪位于热路径上，默认不编译，需要时用KAL_ENABLE_TRACE构建
+#ifdef KAL_ENABLE_TRACE
+extern cl::opt<bool> g_trace_parse;
+#define TRACE_PARSE(message)                    \
+    do                                          \
+    {                                           \
+        if (g_trace_parse)                      \
+        {                                       \
+            traceStream() << message << '\n';   \
+        }                                       \
+    } while (0)
+#else
+#define TRACE_PARSE(message) \
+    do                       \
+    {                        \
+    } while (0)
+#endif
+
+// 浮点运算允许重结合、忽略NaN/无穷等, 见ASTContext::irBuilder
+extern cl::opt<bool> g_fast_math;
+// 解析时折叠常量、化简恒等式并合并相同的纯子表达式, 见Parser::makeBinary
+extern cl::opt<bool> g_simplify_ast;
+// JIT代码统计每个函数定义的调用次数和自身耗时, 见FunctionAST::emitProfileCounters
+extern cl::opt<bool> g_profile_functions;
+
+class PrototypeAST;
+class PrototypeTable;
+class ExprAST;
+
+// 驻留后的标识符ID, 见SymbolTable
+typedef unsigned Symbol;
+
+// 值的类型, 分别对应LLVM的double、i64、i1和指向KalArray的指针。
+// 没有标注类型的参数和返回值为double, 没有标注类型的变量(TYPE_AUTO)取初始值的类型
+enum ValueType : uint8_t
+{
+    TYPE_AUTO,
+    TYPE_DOUBLE,
+    TYPE_INT,
+    TYPE_BOOL,
+    TYPE_ARRAY
+};
+
+// array类型的参数在宿主程序中的表示: 以指针传入, 数据由宿主程序持有。
+// 对应LLVM类型 { double*, i64 }*
+struct KalArray
+{
+    double *data;
+    int64_t length;
+};
+
+class ASTContext;
+
+// 正在生成的逐元素循环(sum/min/max/store的参数)。循环体中读取array变量得到
+// 下标index处的元素, 循环次数是所有用到的数组长度的最小值
+// KalArray对应的LLVM结构体{double*, i64}。数组值是指向它的指针, 取字段时用这个类型,
+// 不从指针类型读取(LLVM已经弃用指针的元素类型)
+inline StructType *kalArrayType(LLVMContext &llvmContext)
+{
+    return StructType::get(Type::getDoublePtrTy(llvmContext), Type::getInt64Ty(llvmContext));
+}
+
+struct ElementLoop
+{
+    // 循环前的block, 数组的指针和长度在这里读取
+    BasicBlock *preheader;
+    Value *index;
+    // 还没有用到数组时为nullptr
+    Value *length;
+
+    // 在preheader中读取数组的数据指针, 并把数组长度计入循环次数
+    Value *bind(Value *array);
+};
+
+// 按优化级别(0-3)向函数级pass管理器中添加优化pass。
+// targetMachine不为空时循环向量化等pass按目标机器的代价模型决策
+void addOptimizationPasses(legacy::FunctionPassManager &fpm, unsigned level,
+                           TargetMachine *targetMachine = nullptr);
+
+class ASTContext
+{
+public:
+    // 持有LLVMContext, 生成的module交给JIT时共享同一个context
+    orc::ThreadSafeContext threadSafeContext;
+    // 记录了LLVM的核心数据结构，比如类型和常量表，不过我们不太需要关心它的内部
+    LLVMContext &llvmContext;
+    // 用于创建LLVM指令
+    IRBuilder<> irBuilder;
+    // 用于管理函数和全局变量，可以粗浅地理解为类c++的编译单元(单个cpp文件)
+    unique_ptr<Module> module;
+    // 当前可见的变量(参数、循环变量和var定义的局部变量)在入口block中的alloca
+    DenseMap<Symbol, AllocaInst *> namedValues;
+    // 记录所有声明过的函数接口，module交给JIT后，新的module可以据此重新声明函数。
+    // 并行编译时多个ASTContext共享同一个表
+    shared_ptr<PrototypeTable> functionProtos;
+    // 每个函数生成之后立即执行的优化pass, 与module一一对应
+    unique_ptr<legacy::FunctionPassManager> passManager;
+    DataLayout dataLayout;
+    unsigned optLevel;
+    // 不被ASTContext持有, 可以为空; TargetMachine不是线程安全的, 不能在线程间共享
+    TargetMachine *targetMachine;
+    // 不在逐元素循环中时为nullptr
+    ElementLoop *elementLoop = nullptr;
+    // 正在生成的纯表达式中已经生成的节点的值, 不在纯表达式中时为nullptr, 见pureValue
+    DenseMap<const ExprAST *, Value *> *pureValues = nullptr;
+
+public:
+    ASTContext(const DataLayout &dataLayout = DataLayout(""), unsigned optLevel = 0,
+               shared_ptr<PrototypeTable> functionProtos = make_shared<PrototypeTable>(),
+               TargetMachine *targetMachine = nullptr)
+        : threadSafeContext(make_unique<LLVMContext>()),
+          llvmContext(*threadSafeContext.getContext()),
+          irBuilder(llvmContext),
+          functionProtos(move(functionProtos)),
+          dataLayout(dataLayout),
+          optLevel(optLevel),
+          targetMachine(targetMachine)
+    {
+        // 作为irBuilder的默认标志, 所有浮点运算和返回浮点数的调用(包括数学intrinsic)都带上
+        if (g_fast_math)
+        {
+            irBuilder.setFastMathFlags(FastMathFlags::getFast());
+        }
+        resetModule();
+    }
+
+    void resetModule()
+    {
+        module = make_unique<Module>("my cool jit", llvmContext);
+        module->setDataLayout(dataLayout);
+        passManager = make_unique<legacy::FunctionPassManager>(module.get());
+        addOptimizationPasses(*passManager, optLevel, targetMachine);
+        passManager->doInitialization();
+    }
+    // 对整个module做过程间优化: 推断函数属性(比如纯double函数的readnone、nounwind)、
+    // 跨调用传播常量、把小函数内联进调用者, 然后对每个函数重新执行函数级优化。
+    // 用于一次编译多个定义的module; 逐个编译的定义各在一个module中, 可以单独重新定义, 不跨module内联
+    void optimizeModule();
+    // 取出当前module交给JIT，后续的IR写入新的module
+    orc::ThreadSafeModule takeModule()
+    {
+        orc::ThreadSafeModule tsm(move(module), threadSafeContext);
+        resetModule();
+        return tsm;
+    }
+
+    Value *doubleValue(double v)
+    {
+        return ConstantFP::get(llvmContext, APFloat(v));
+    }
+    // KalArray*
+    PointerType *arrayType()
+    {
+        return kalArrayType(llvmContext)->getPointerTo();
+    }
+    // TYPE_AUTO没有对应的LLVM类型, 返回nullptr
+    Type *llvmType(ValueType type)
+    {
+        switch (type)
+        {
+        case TYPE_ARRAY:
+            return arrayType();
+        case TYPE_DOUBLE:
+            return Type::getDoubleTy(llvmContext);
+        case TYPE_INT:
+            return Type::getInt64Ty(llvmContext);
+        case TYPE_BOOL:
+            return Type::getInt1Ty(llvmContext);
+        case TYPE_AUTO:
+            break;
+        }
+        return nullptr;
+    }
+    AllocaInst *namedValue(Symbol name)
+    {
+        auto it = namedValues.find(name);
+        return it != namedValues.end() ? it->second : nullptr;
+    }
+    void namedValue(Symbol name, AllocaInst *value)
+    {
+        namedValues[name] = value;
+    }
+    // 在当前函数的入口block中为变量分配栈空间, mem2reg/SROA会把它提升为寄存器
+    AllocaInst *createEntryBlockAlloca(Symbol name, Type *type);
+    void namedClear()
+    {
+        namedValues.clear();
+    }
+
+    // 在当前module中查找函数，找不到则根据记录的函数接口重新声明
+    Function *getFunction(Symbol name);
+    // 生成纯表达式(见ExprAST::pure)中的节点expr。纯表达式没有赋值、调用和控制流,
+    // 整个在同一个block中生成, 共享的子树只生成一次
+    Value *pureValue(const ExprAST *expr, function_ref<Value *()> emit);
+};
+
+//
+
+#ifndef __cpp_lib_make_unique
+template <typename T, typename... Ts>
+unique_ptr<T> make_unique(Ts &&...params)
+{
+    return unique_ptr<T>(new T(forward<Ts>(params)...));
+}
+#endif
+
+//
+
+// 二元操作符优先级表, 下标为操作符的ASCII值, -1表示不是二元操作符。
+// 内置操作符在编译期填好，自定义操作符可以在运行时注册
+class BinopPrecedenceTable
+{
+private:
+    int precedence_[256];
+
+public:
+    constexpr BinopPrecedenceTable() : precedence_()
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            precedence_[i] = -1;
+        }
+        // 定义优先级
+        precedence_[':'] = 1; // 顺序求值, 取右边的值
+        precedence_['='] = 2; // 赋值
+        precedence_['<'] = 10;
+        precedence_['+'] = 20;
+        precedence_['-'] = 20;
+        precedence_['*'] = 40;
+    }
+
+    // token可能是负数的Token枚举值, 一律视为非操作符
+    int get(int token) const
+    {
+        return (unsigned)token < 256 ? precedence_[token] : -1;
+    }
+    void set(unsigned char op, int precedence)
+    {
+        precedence_[op] = precedence;
+    }
+    void remove(unsigned char op)
+    {
+        precedence_[op] = -1;
+    }
+};
+
+extern BinopPrecedenceTable g_binop_precedence;
+
+// 如果不是以下几种情况，Lexer返回[0-255]的ASCII值，否则返回以下枚举值
+enum Token
+{
+    TOKEN_EOF = -1,        // 文件结束标识符
+    TOKEN_DEF = -2,        // 关键字def
+    TOKEN_EXTERN = -3,     // 关键字extern
+    TOKEN_IDENTIFIER = -4, // 名字
+    TOKEN_NUMBER = -5,     // 数值
+    // 控制流
+    TOKEN_IF = -6,
+    TOKEN_THEN = -7,
+    TOKEN_ELSE = -8,
+    TOKEN_FOR = -9,
+    TOKEN_IN = -10,
+    TOKEN_VAR = -11,
+    TOKEN_MEMO = -12 // 关键字memo, 用在def之前
+};
+
+// 关键字, 按顺序最先驻留到符号表中, 符号ID即为下标
+const pair<const char *, int> g_keywords[] = {
+    {"def", TOKEN_DEF}, {"extern", TOKEN_EXTERN},
+    {"if", TOKEN_IF}, {"then", TOKEN_THEN}, {"else", TOKEN_ELSE},
+    {"for", TOKEN_FOR}, {"in", TOKEN_IN}, {"var", TOKEN_VAR}, {"memo", TOKEN_MEMO}};
+const Symbol g_keyword_count = sizeof(g_keywords) / sizeof(g_keywords[0]);
+
+// 内置函数, 紧接着关键字驻留, 符号ID为g_keyword_count加上枚举值。
+// 调用时优先于同名的用户函数
+enum Builtin
+{
+    BUILTIN_SUM,   // sum(expr): 逐元素求和
+    BUILTIN_MIN,   // min(expr): 逐元素最小值, 空数组为+inf
+    BUILTIN_MAX,   // max(expr): 逐元素最大值, 空数组为-inf
+    BUILTIN_STORE, // store(out, expr): 逐元素写入out, 值为0.0
+    BUILTIN_LEN,   // len(array): 数组长度
+    BUILTIN_COUNT
+};
+const char *const g_builtins[BUILTIN_COUNT] = {"sum", "min", "max", "store", "len"};
+
+// 全局符号表, 每个不同的标识符只保存一份字符串, 用连续的整数ID表示,
+// AST中只记录ID, 比较标识符即比较整数。
+// intern()只能由一个线程(解析线程)调用, name()和find()可以在任意线程中调用
+class SymbolTable
+{
+private:
+    StringMap<Symbol> ids;
+    // 下标为符号ID, 字符串由ids持有
+    vector<StringRef> names;
+    // 保护names的扩容, 只在插入新符号时加写锁
+    mutable shared_timed_mutex namesLock;
+
+public:
+    SymbolTable()
+    {
+        for (auto &keyword : g_keywords)
+        {
+            intern(keyword.first);
+        }
+        for (const char *builtin : g_builtins)
+        {
+            intern(builtin);
+        }
+    }
+
+    Symbol intern(StringRef name)
+    {
+        auto it = ids.find(name);
+        if (it != ids.end())
+        {
+            return it->second;
+        }
+        lock_guard<shared_timed_mutex> lock(namesLock);
+        auto result = ids.try_emplace(name, (Symbol)names.size());
+        names.push_back(result.first->getKey());
+        return result.first->second;
+    }
+    // 不插入新符号的查找, 没有驻留过时返回None
+    Optional<Symbol> find(StringRef name) const
+    {
+        shared_lock<shared_timed_mutex> lock(namesLock);
+        auto it = ids.find(name);
+        if (it == ids.end())
+        {
+            return None;
+        }
+        return it->second;
+    }
+    StringRef name(Symbol symbol) const
+    {
+        shared_lock<shared_timed_mutex> lock(namesLock);
+        return names[symbol];
+    }
+    bool isKeyword(Symbol symbol) const
+    {
+        return symbol < g_keyword_count;
+    }
+    bool isBuiltin(Symbol symbol) const
+    {
+        return symbol >= g_keyword_count && symbol < g_keyword_count + BUILTIN_COUNT;
+    }
+};
+
+extern SymbolTable g_symbols;
+
+// 顶层表达式被包装成的匿名函数名
+extern const string g_anon_expr_name;
+
+//
+
+class ExprAST;
+
+// AST节点的内存池, 每个顶层item(函数定义、extern、顶层表达式)一个。
+// 节点只分配不单独释放，item处理完后随内存池一次性释放，节点的析构函数
+// 不会被调用，因此节点中只能持有指针、ArrayRef这类无需析构的成员
+class ASTArena
+{
+private:
+    BumpPtrAllocator allocator;
+
+public:
+    template <typename T, typename... Ts>
+    T *make(Ts &&...params)
+    {
+        return new (allocator.Allocate<T>()) T(forward<Ts>(params)...);
+    }
+    // 把临时数组复制到内存池中
+    template <typename T>
+    ArrayRef<T> copy(ArrayRef<T> items)
+    {
+        T *data = allocator.Allocate<T>(items.size());
+        uninitialized_copy(items.begin(), items.end(), data);
+        return ArrayRef<T>(data, items.size());
+    }
+};
+
+// 打印错误信息, 返回nullptr
+ExprAST *LogError(const char *str);
+Value *LogErrorV(const char *str);
+
+// 在作用域内收集当前线程中LogError报告的错误, 不再打印到stderr。可以嵌套
+class ErrorCapture
+{
+private:
+    static thread_local ErrorCapture *current_;
+    ErrorCapture *previous_;
+    vector<string> messages_;
+
+public:
+    ErrorCapture() : previous_(current_) { current_ = this; }
+    ~ErrorCapture() { current_ = previous_; }
+    ErrorCapture(const ErrorCapture &) = delete;
+    ErrorCapture &operator=(const ErrorCapture &) = delete;
+
+    // 当前线程最内层的ErrorCapture, 没有时为nullptr
+    static ErrorCapture *current() { return current_; }
+    void report(const char *message) { messages_.push_back(message); }
+    bool empty() const { return messages_.empty(); }
+    // 取出收集到的错误信息, 可以交给其他线程再报告
+    vector<string> takeMessages() { return move(messages_); }
+    // 取出收集到的错误, 没有错误时为Error::success()
+    Error takeError();
+};
+
+// 生成二元操作的IR, 树形AST和扁平AST共用
+Value *emitBinaryOp(ASTContext &context, char op, Value *lhs, Value *rhs);
+
+// 在builder的插入位置把value转换为type(double、i64、i1之间), 类型相同时原样返回。
+// 转为i1即判断是否不等于0; 数组不能和其它类型互相转换, 报错并返回nullptr
+Value *convertValue(IRBuilder<> &builder, Value *value, Type *type);
+
+// 生成函数调用(包括内置函数), arg(i)生成第i个参数, 树形AST和扁平AST共用
+Value *emitCallExpr(ASTContext &context, Symbol callee, size_t count,
+                    function_ref<Value *(size_t)> arg);
+
+// 读取变量/给变量赋值, 树形AST和扁平AST共用
+Value *emitVariable(ASTContext &context, Symbol name);
+Value *emitAssignment(ASTContext &context, Symbol name, Value *value);
+
+// 生成if/then/else的分支和PHI节点, 三个回调分别生成各部分的值, 树形AST和扁平AST共用
+Value *emitIfExpr(ASTContext &context, function_ref<Value *()> cond,
+                  function_ref<Value *()> then, function_ref<Value *()> otherwise);
+
+// 生成for循环, 回调分别生成起始值、循环条件、步长和循环体, 树形AST和扁平AST共用。
+// type为TYPE_AUTO时循环变量取起始值的类型
+Value *emitForExpr(ASTContext &context, Symbol var, ValueType type, function_ref<Value *()> start,
+                   function_ref<Value *()> end, function_ref<Value *()> step,
+                   function_ref<Value *()> body);
+
+// 生成var表达式: 依次用init(i)初始化类型为types[i]的变量names[i], 然后在这些
+// 变量可见的作用域中生成body
+Value *emitVarExpr(ASTContext &context, ArrayRef<Symbol> names, ArrayRef<ValueType> types,
+                   function_ref<Value *(size_t)> init, function_ref<Value *()> body);
+
+// 表达式节点的类型, 用于isa<>/dyn_cast<>以及扁平AST的分派
+enum ExprKind : uint8_t
+{
+    EXPR_NUMBER,
+    EXPR_VARIABLE,
+    EXPR_BINARY,
+    EXPR_CALL,
+    EXPR_IF,
+    EXPR_FOR,
+    EXPR_VAR
+};
+
+// 把表达式的结构写入hasher, 树形AST和扁平AST写入的内容相同
+void hashExpr(MD5 &hasher, const ExprAST *expr);
+namespace ast_hash
+{
+    void kind(MD5 &hasher, ExprKind kind);
+    void number(MD5 &hasher, double val);
+    void symbol(MD5 &hasher, Symbol symbol);
+    void op(MD5 &hasher, char op);
+    void count(MD5 &hasher, uint32_t count);
+    void type(MD5 &hasher, ValueType type);
+}
+
+// 所有 `表达式` 节点的基类
+class ExprAST
+{
+private:
+    const ExprKind kind_;
+    const bool pure_;
+
+public:
+    ExprAST(ExprKind kind, bool pure = false) : kind_(kind), pure_(pure) {}
+
+    virtual ~ExprAST() {}
+    virtual Value *CodeGen(ASTContext &context) = 0;
+
+    ExprKind kind() const { return kind_; }
+    // 只由字面值、变量和 + - * < 组成, 求值没有副作用, 解析时相同的纯子树共享同一个节点
+    bool pure() const { return pure_; }
+};
+
+// 字面值表达式
+class NumberExprAST : public ExprAST
+{
+private:
+    double val_;
+
+public:
+    NumberExprAST(double val) : ExprAST(EXPR_NUMBER, true), val_(val) {}
+    static bool classof(const ExprAST *expr) { return expr->kind() == EXPR_NUMBER; }
+
+    double val() const { return val_; }
+    Value *CodeGen(ASTContext &context) override
+    {
+        return context.doubleValue(val_);
+    }
+};
+
+// 变量表达式
+class VariableExprAST : public ExprAST
+{
+private:
+    Symbol name_;
+
+public:
+    VariableExprAST(Symbol name) : ExprAST(EXPR_VARIABLE, true), name_(name) {}
+    static bool classof(const ExprAST *expr) { return expr->kind() == EXPR_VARIABLE; }
+
+    Symbol name() const { return name_; }
+    Value *CodeGen(ASTContext &context) override
+    {
+        return context.pureValue(this, [&]()
+                                 { return emitVariable(context, name_); });
+    }
+};
+
+// 二元操作表达式
+class BinaryExprAST : public ExprAST
+{
+private:
+    char op_;
+    ExprAST *lhs_;
+    ExprAST *rhs_;
+
+public:
+    BinaryExprAST(char op, ExprAST *lhs, ExprAST *rhs)
+        : ExprAST(EXPR_BINARY, StringRef("+-*<").contains(op) && lhs->pure() && rhs->pure()),
+          op_(op), lhs_(lhs), rhs_(rhs) {}
+    static bool classof(const ExprAST *expr) { return expr->kind() == EXPR_BINARY; }
+
+    char op() const { return op_; }
+    ExprAST *lhs() const { return lhs_; }
+    ExprAST *rhs() const { return rhs_; }
+
+    Value *CodeGen(ASTContext &context) override
+    {
+        if (op_ == '=')
+        {
+            // 赋值的左边必须是变量, 不对它求值
+            auto *var = dyn_cast<VariableExprAST>(lhs_);
+            if (var == nullptr)
+            {
+                return LogErrorV("destination of '=' must be a variable");
+            }
+            return emitAssignment(context, var->name(), rhs_->CodeGen(context));
+        }
+        auto emit = [&]() -> Value *
+        {
+            Value *lhs = lhs_->CodeGen(context);
+            Value *rhs = rhs_->CodeGen(context);
+            if (lhs == nullptr || rhs == nullptr)
+            {
+                return nullptr;
+            }
+            return emitBinaryOp(context, op_, lhs, rhs);
+        };
+        return pure() ? context.pureValue(this, emit) : emit();
+    }
+};
+
+// 函数调用表达式
+class CallExprAST : public ExprAST
+{
+private:
+    Symbol callee_;
+    ArrayRef<ExprAST *> args_;
+
+public:
+    CallExprAST(Symbol callee, ArrayRef<ExprAST *> args)
+        : ExprAST(EXPR_CALL), callee_(callee), args_(args) {}
+    static bool classof(const ExprAST *expr) { return expr->kind() == EXPR_CALL; }
+
+    Symbol callee() const { return callee_; }
+    ArrayRef<ExprAST *> args() const { return args_; }
+
+    Value *CodeGen(ASTContext &context) override
+    {
+        return emitCallExpr(context, callee_, args_.size(), [&](size_t i)
+                            { return args_[i]->CodeGen(context); });
+    }
+};
+
+// 条件表达式 if cond then a else b, cond不等于0.0时取a
+class IfExprAST : public ExprAST
+{
+private:
+    ExprAST *cond_;
+    ExprAST *then_;
+    ExprAST *else_;
+
+public:
+    IfExprAST(ExprAST *cond, ExprAST *then, ExprAST *otherwise)
+        : ExprAST(EXPR_IF), cond_(cond), then_(then), else_(otherwise) {}
+    static bool classof(const ExprAST *expr) { return expr->kind() == EXPR_IF; }
+
+    ExprAST *cond() const { return cond_; }
+    ExprAST *thenExpr() const { return then_; }
+    ExprAST *elseExpr() const { return else_; }
+
+    Value *CodeGen(ASTContext &context) override
+    {
+        return emitIfExpr(
+            context, [&]()
+            { return cond_->CodeGen(context); },
+            [&]()
+            { return then_->CodeGen(context); },
+            [&]()
+            { return else_->CodeGen(context); });
+    }
+};
+
+// 循环表达式 for var[:type] = start, end, step in body。
+// 与C的for相同, 每次执行body前检查end是否不等于0, 省略step时为1; 值总是0.0
+class ForExprAST : public ExprAST
+{
+private:
+    Symbol var_;
+    ValueType type_;
+    ExprAST *start_;
+    ExprAST *end_;
+    ExprAST *step_;
+    ExprAST *body_;
+
+public:
+    ForExprAST(Symbol var, ValueType type, ExprAST *start, ExprAST *end, ExprAST *step, ExprAST *body)
+        : ExprAST(EXPR_FOR), var_(var), type_(type), start_(start), end_(end), step_(step), body_(body) {}
+    static bool classof(const ExprAST *expr) { return expr->kind() == EXPR_FOR; }
+
+    Symbol var() const { return var_; }
+    ValueType type() const { return type_; }
+    ExprAST *start() const { return start_; }
+    ExprAST *end() const { return end_; }
+    ExprAST *step() const { return step_; }
+    ExprAST *body() const { return body_; }
+
+    Value *CodeGen(ASTContext &context) override
+    {
+        return emitForExpr(
+            context, var_, type_, [&]()
+            { return start_->CodeGen(context); },
+            [&]()
+            { return end_->CodeGen(context); },
+            [&]()
+            { return step_->CodeGen(context); },
+            [&]()
+            { return body_->CodeGen(context); });
+    }
+};
+
+// 局部变量表达式 var a = 1, b:int in body, 省略初始值时为0, 变量只在body中可见
+class VarExprAST : public ExprAST
+{
+private:
+    ArrayRef<Symbol> names_;
+    ArrayRef<ValueType> types_;
+    ArrayRef<ExprAST *> inits_;
+    ExprAST *body_;
+
+public:
+    VarExprAST(ArrayRef<Symbol> names, ArrayRef<ValueType> types, ArrayRef<ExprAST *> inits, ExprAST *body)
+        : ExprAST(EXPR_VAR), names_(names), types_(types), inits_(inits), body_(body) {}
+    static bool classof(const ExprAST *expr) { return expr->kind() == EXPR_VAR; }
+
+    ArrayRef<Symbol> names() const { return names_; }
+    ArrayRef<ValueType> types() const { return types_; }
+    ArrayRef<ExprAST *> inits() const { return inits_; }
+    ExprAST *body() const { return body_; }
+
+    Value *CodeGen(ASTContext &context) override
+    {
+        return emitVarExpr(
+            context, names_, types_, [&](size_t i)
+            { return inits_[i]->CodeGen(context); },
+            [&]()
+            { return body_->CodeGen(context); });
+    }
+};
+
+// 扁平编码的表达式: 所有节点连续存放在一个数组中，用32位下标引用子节点，
+// codegen按kind做switch分派，没有虚函数调用，遍历时的内存访问也更连续
+class FlatExprAST
+{
+public:
+    typedef uint32_t NodeId;
+
+    struct Node
+    {
+        ExprKind kind;
+        char op;       // EXPR_BINARY: 操作符, EXPR_FOR: 循环变量的ValueType
+        // EXPR_VARIABLE, EXPR_FOR: 变量名, EXPR_CALL: 被调函数名
+        // EXPR_VAR: 各变量的类型在varTypes_[symbol, symbol + count)中
+        Symbol symbol;
+        union
+        {
+            double number; // EXPR_NUMBER
+            struct
+            {
+                NodeId lhs, rhs;
+            } binary;
+            // 参数下标在args_[first, first + count)中
+            struct
+            {
+                uint32_t first, count;
+            } call;
+            // EXPR_IF: cond, then, else的下标依次在args_[first, first + 3)中
+            // EXPR_FOR: start, end, step, body的下标依次在args_[first, first + 4)中
+            // EXPR_VAR: args_[first, first + count)为变量名, 随后count个为初始值, 最后是body
+            struct
+            {
+                uint32_t first;
+            } branch;
+        };
+    };
+
+private:
+    vector<Node> nodes_;
+    vector<NodeId> args_;
+    vector<ValueType> varTypes_;
+    NodeId root_ = 0;
+
+public:
+    // 把树形AST转为扁平编码, 子节点总是先于父节点存放
+    static unique_ptr<FlatExprAST> Build(const ExprAST *root)
+    {
+        auto flat = make_unique<FlatExprAST>();
+        flat->root_ = flat->add(root);
+        return flat;
+    }
+
+    Value *CodeGen(ASTContext &context) const
+    {
+        return CodeGen(context, root_);
+    }
+
+    void hash(MD5 &hasher) const
+    {
+        hash(hasher, root_);
+    }
+
+    // 调用的函数(不含内置函数), 可能重复
+    void callees(SmallVectorImpl<Symbol> &result) const
+    {
+        for (const Node &node : nodes_)
+        {
+            if (node.kind == EXPR_CALL && !g_symbols.isBuiltin(node.symbol))
+            {
+                result.push_back(node.symbol);
+            }
+        }
+    }
+
+private:
+    void hash(MD5 &hasher, NodeId id) const
+    {
+        const Node &node = nodes_[id];
+        ast_hash::kind(hasher, node.kind);
+        switch (node.kind)
+        {
+        case EXPR_NUMBER:
+            ast_hash::number(hasher, node.number);
+            break;
+        case EXPR_VARIABLE:
+            ast_hash::symbol(hasher, node.symbol);
+            break;
+        case EXPR_BINARY:
+            ast_hash::op(hasher, node.op);
+            hash(hasher, node.binary.lhs);
+            hash(hasher, node.binary.rhs);
+            break;
+        case EXPR_CALL:
+            ast_hash::symbol(hasher, node.symbol);
+            ast_hash::count(hasher, node.call.count);
+            for (uint32_t i = 0; i < node.call.count; i++)
+            {
+                hash(hasher, args_[node.call.first + i]);
+            }
+            break;
+        case EXPR_IF:
+            for (uint32_t i = 0; i < 3; i++)
+            {
+                hash(hasher, args_[node.branch.first + i]);
+            }
+            break;
+        case EXPR_FOR:
+            ast_hash::symbol(hasher, node.symbol);
+            ast_hash::type(hasher, (ValueType)node.op);
+            for (uint32_t i = 0; i < 4; i++)
+            {
+                hash(hasher, args_[node.branch.first + i]);
+            }
+            break;
+        case EXPR_VAR:
+            ast_hash::count(hasher, node.call.count);
+            for (uint32_t i = 0; i < node.call.count; i++)
+            {
+                ast_hash::symbol(hasher, args_[node.call.first + i]);
+                ast_hash::type(hasher, varTypes_[node.symbol + i]);
+                hash(hasher, args_[node.call.first + node.call.count + i]);
+            }
+            hash(hasher, args_[node.call.first + 2 * node.call.count]);
+            break;
+        }
+    }
+
+    NodeId add(const ExprAST *expr)
+    {
+        Node node;
+        node.kind = expr->kind();
+        node.op = 0;
+        node.symbol = 0;
+        switch (expr->kind())
+        {
+        case EXPR_NUMBER:
+            node.number = cast<NumberExprAST>(expr)->val();
+            break;
+        case EXPR_VARIABLE:
+            node.symbol = cast<VariableExprAST>(expr)->name();
+            break;
+        case EXPR_BINARY:
+        {
+            auto *binary = cast<BinaryExprAST>(expr);
+            node.op = binary->op();
+            node.binary.lhs = add(binary->lhs());
+            node.binary.rhs = add(binary->rhs());
+            break;
+        }
+        case EXPR_CALL:
+        {
+            auto *call = cast<CallExprAST>(expr);
+            // 先添加所有参数节点, 再把参数下标连续地放入args_
+            SmallVector<NodeId, 8> args;
+            for (const ExprAST *arg : call->args())
+            {
+                args.push_back(add(arg));
+            }
+            node.symbol = call->callee();
+            node.call.first = args_.size();
+            node.call.count = args.size();
+            args_.insert(args_.end(), args.begin(), args.end());
+            break;
+        }
+        case EXPR_IF:
+        {
+            auto *branch = cast<IfExprAST>(expr);
+            NodeId children[] = {add(branch->cond()), add(branch->thenExpr()), add(branch->elseExpr())};
+            node.branch.first = args_.size();
+            args_.insert(args_.end(), begin(children), end(children));
+            break;
+        }
+        case EXPR_FOR:
+        {
+            auto *loop = cast<ForExprAST>(expr);
+            NodeId children[] = {add(loop->start()), add(loop->end()), add(loop->step()), add(loop->body())};
+            node.symbol = loop->var();
+            node.op = loop->type();
+            node.branch.first = args_.size();
+            args_.insert(args_.end(), begin(children), end(children));
+            break;
+        }
+        case EXPR_VAR:
+        {
+            auto *var = cast<VarExprAST>(expr);
+            SmallVector<NodeId, 8> children;
+            for (const ExprAST *init : var->inits())
+            {
+                children.push_back(add(init));
+            }
+            children.push_back(add(var->body()));
+            node.symbol = varTypes_.size();
+            varTypes_.insert(varTypes_.end(), var->types().begin(), var->types().end());
+            node.call.first = args_.size();
+            node.call.count = var->names().size();
+            args_.insert(args_.end(), var->names().begin(), var->names().end());
+            args_.insert(args_.end(), children.begin(), children.end());
+            break;
+        }
+        }
+        nodes_.push_back(node);
+        return nodes_.size() - 1;
+    }
+
+    Value *CodeGen(ASTContext &context, NodeId id) const
+    {
+        const Node &node = nodes_[id];
+        switch (node.kind)
+        {
+        case EXPR_NUMBER:
+            return context.doubleValue(node.number);
+        case EXPR_VARIABLE:
+            return emitVariable(context, node.symbol);
+        case EXPR_BINARY:
+        {
+            if (node.op == '=')
+            {
+                const Node &lhs = nodes_[node.binary.lhs];
+                if (lhs.kind != EXPR_VARIABLE)
+                {
+                    return LogErrorV("destination of '=' must be a variable");
+                }
+                return emitAssignment(context, lhs.symbol, CodeGen(context, node.binary.rhs));
+            }
+            Value *lhs = CodeGen(context, node.binary.lhs);
+            Value *rhs = CodeGen(context, node.binary.rhs);
+            if (lhs == nullptr || rhs == nullptr)
+            {
+                return nullptr;
+            }
+            return emitBinaryOp(context, node.op, lhs, rhs);
+        }
+        case EXPR_CALL:
+        {
+            return emitCallExpr(context, node.symbol, node.call.count, [&](size_t i)
+                                { return CodeGen(context, args_[node.call.first + i]); });
+        }
+        case EXPR_IF:
+        {
+            const NodeId *branch = &args_[node.branch.first];
+            return emitIfExpr(
+                context, [&]()
+                { return CodeGen(context, branch[0]); },
+                [&]()
+                { return CodeGen(context, branch[1]); },
+                [&]()
+                { return CodeGen(context, branch[2]); });
+        }
+        case EXPR_FOR:
+        {
+            const NodeId *loop = &args_[node.branch.first];
+            return emitForExpr(
+                context, node.symbol, (ValueType)node.op, [&]()
+                { return CodeGen(context, loop[0]); },
+                [&]()
+                { return CodeGen(context, loop[1]); },
+                [&]()
+                { return CodeGen(context, loop[2]); },
+                [&]()
+                { return CodeGen(context, loop[3]); });
+        }
+        case EXPR_VAR:
+        {
+            // 变量名和节点下标都是32位整数, 共用args_
+            ArrayRef<Symbol> names(&args_[node.call.first], node.call.count);
+            const NodeId *inits = &args_[node.call.first + node.call.count];
+            ArrayRef<ValueType> types(&varTypes_[node.symbol], node.call.count);
+            return emitVarExpr(
+                context, names, types, [&](size_t i)
+                { return CodeGen(context, inits[i]); },
+                [&]()
+                { return CodeGen(context, inits[node.call.count]); });
+        }
+        }
+        return nullptr;
+    }
+};
+
+// 函数接口
+class PrototypeAST
+{
+private:
+    Symbol name_;
+    vector<Symbol> args_;
+    vector<ValueType> argTypes_;
+    ValueType returnType_;
+
+public:
+    // argTypes为空时参数都是double
+    PrototypeAST(Symbol name, vector<Symbol> args, vector<ValueType> argTypes = {},
+                 ValueType returnType = TYPE_DOUBLE)
+        : name_(name), args_(move(args)), argTypes_(move(argTypes)), returnType_(returnType)
+    {
+        argTypes_.resize(args_.size(), TYPE_DOUBLE);
+    }
+    Symbol name() const { return name_; }
+    const vector<Symbol> &args() const { return args_; }
+    const vector<ValueType> &argTypes() const { return argTypes_; }
+    ValueType returnType() const { return returnType_; }
+
+    Function *CodeGen(ASTContext &context)
+    {
+        // 创建kaleidoscope的函数类型, 比如 double (double, i64, ..., double)
+        vector<Type *> arg_types;
+        for (ValueType type : argTypes_)
+        {
+            arg_types.push_back(context.llvmType(type));
+        }
+        // 函数类型是唯一的，所以使用get而不是new/create
+        FunctionType *function_type = FunctionType::get(context.llvmType(returnType_), arg_types, false);
+        // 创建函数, ExternalLinkage意味着函数可能不在当前module中定义，在当前module
+        // 即context.module中注册名字为name_, 后面可以使用这个名字在module中查询
+        Function *func = Function::Create(
+            function_type, Function::ExternalLinkage, g_symbols.name(name_), context.module.get());
+        // 增加IR可读性，设置function的argument name
+        int index = 0;
+        for (auto &arg : func->args())
+        {
+            arg.setName(g_symbols.name(args_[index++]));
+            // 与C/C++的bool调用约定一致, 宿主程序可以直接传入和接收bool
+            if (arg.getType()->isIntegerTy(1))
+            {
+                arg.addAttr(Attribute::ZExt);
+            }
+        }
+        if (returnType_ == TYPE_BOOL)
+        {
+            func->addRetAttr(Attribute::ZExt);
+        }
+        return func;
+    }
+};
+
+// 所有声明过的函数接口, 可以被多个线程中的ASTContext共享
+class PrototypeTable
+{
+private:
+    mutable mutex lock_;
+    map<Symbol, unique_ptr<PrototypeAST>> protos_;
+    // 声明为extern的libm数学函数对应的intrinsic, 没有对应的intrinsic时为Intrinsic::not_intrinsic
+    DenseMap<Symbol, Intrinsic::ID> mathFunctions_;
+    // 声明为extern且没有被定义覆盖的函数
+    DenseSet<Symbol> externs_;
+
+public:
+    // 记录(或覆盖)一个函数接口
+    void add(const PrototypeAST &proto);
+    // 记录extern声明的接口。名字、参数个数与libm的数学函数一致且都是double时,
+    // 之后的调用生成对应的intrinsic(比如llvm.sin), 优化器可以常量折叠和向量化
+    void addExtern(const PrototypeAST &proto);
+    // 记录函数定义的接口。之前记录过的接口与它不同时报错并返回false:
+    // 重新定义函数时已经编译的调用者不会重新编译, 仍然按照原来的接口调用
+    bool define(const PrototypeAST &proto);
+    // 根据记录的接口在context.module中声明函数, 没有记录时返回nullptr
+    Function *declare(Symbol name, ASTContext &context) const;
+    // 记录的函数接口的副本, 没有记录时返回None
+    Optional<PrototypeAST> find(Symbol name) const;
+    // 调用name时代替它的intrinsic, 没有时返回Intrinsic::not_intrinsic
+    Intrinsic::ID intrinsic(Symbol name) const;
+    // name是extern声明的libm数学函数: 没有副作用, 可以在多个线程中同时调用
+    bool isMathFunction(Symbol name) const;
+    // name是extern声明的宿主函数, 而不是函数定义
+    bool isExtern(Symbol name) const;
+};
+
+// 函数
+class FunctionAST
+{
+private:
+    // 持有body_所有节点的内存, 随FunctionAST一起释放
+    unique_ptr<ASTArena> arena_;
+    unique_ptr<PrototypeAST> proto_;
+    ExprAST *body_;
+    // flatten()之后代替body_
+    unique_ptr<FlatExprAST> flatBody_;
+    // memo def: 结果按参数缓存, 见emitMemoCache
+    bool memoized_ = false;
+
+    // 函数体生成在内部函数compute中, func查缓存表, 不命中时调用compute并写入缓存。
+    // 缓存表是module中的全局变量, 直接映射, 按参数的位模式散列, 冲突时新结果覆盖旧结果,
+    // 每一项用自旋锁保护, 可以在多个线程中调用
+    void emitMemoCache(ASTContext &context, Function *func, Function *compute) const;
+    // --profile-functions: 在优化过的func中插入计数: 入口处调用次数加一(countCalls时)并读取周期计数器,
+    // 每次调用其他函数定义前后读取周期计数器, 累计的时间从自身耗时中扣除, 返回前把自身耗时
+    // 累加到计数器。在函数级优化之后插入, 不妨碍尾递归消除。
+    // memo def的查表函数和内部函数都插入计数, 只有前者计调用次数, 命中缓存的调用也被统计
+    void emitProfileCounters(ASTContext &context, Function *func, bool countCalls) const;
+
+public:
+    FunctionAST(unique_ptr<ASTArena> arena,
+                unique_ptr<PrototypeAST> proto,
+                ExprAST *body)
+        : arena_(move(arena)), proto_(move(proto)), body_(body) {}
+
+    // 把body转为扁平编码，之后codegen走FlatExprAST, 树形节点的内存随之释放
+    void flatten()
+    {
+        flatBody_ = FlatExprAST::Build(body_);
+        body_ = nullptr;
+        arena_.reset();
+    }
+
+    Symbol name() const { return proto_->name(); }
+    const PrototypeAST &proto() const { return *proto_; }
+    // 树形的body, flatten()之后为nullptr
+    const ExprAST *body() const { return body_; }
+    // 函数是纯函数, 按参数缓存结果。函数体中的递归调用也经过缓存, 指数级的递归变为线性
+    void setMemoized(bool memoized) { memoized_ = memoized; }
+    bool memoized() const { return memoized_; }
+
+    // 对象缓存的key: 由函数的AST、优化级别和目标机器决定, flatten()前后相同
+    string cacheKey(StringRef target, unsigned optLevel) const;
+    // 函数体中直接调用的函数(不含内置函数), 可能重复, flatten()前后相同
+    void callees(SmallVectorImpl<Symbol> &result) const;
+
+    Function *CodeGen(ASTContext &context)
+    {
+        PhaseScope scope(PHASE_CODEGEN);
+        // 记录函数接口，之后的module中调用该函数时重新声明
+        Symbol name = proto_->name();
+        if (!context.functionProtos->define(*proto_))
+        {
+            return nullptr;
+        }
+        // 检查函数声明是否已完成codegen(比如之前的extern声明), 如果没有则执行codegen
+        Function *func = context.getFunction(name);
+        if (func == nullptr)
+        {
+            return nullptr;
+        }
+        if (!func->empty())
+        {
+            LogError("function cannot be redefined");
+            return nullptr;
+        }
+        if (func->arg_size() != proto_->args().size())
+        {
+            LogError("redefinition of function with different # args");
+            return nullptr;
+        }
+        if (func->getReturnType() != context.llvmType(proto_->returnType()))
+        {
+            LogError("redefinition of function with different return type");
+            return nullptr;
+        }
+        // 记忆化时函数体生成在内部函数中, func只查缓存
+        Function *body_func = func;
+        if (memoized_)
+        {
+            if (is_contained(proto_->argTypes(), TYPE_ARRAY) || proto_->returnType() == TYPE_ARRAY)
+            {
+                LogError("memo function cannot take or return an array");
+                return nullptr;
+            }
+            body_func = Function::Create(func->getFunctionType(), Function::InternalLinkage,
+                                         func->getName() + ".memo", context.module.get());
+        }
+        // 创建入口block并且设置为指令插入位置, 控制流表达式会在其后追加block
+        BasicBlock *block = BasicBlock::Create(context.llvmContext, "entry", body_func);
+        context.irBuilder.SetInsertPoint(block);
+        // 参数和局部变量一样存放在alloca中, 这样也可以被赋值
+        context.namedClear();
+        unsigned index = 0;
+        for (Value &arg : body_func->args())
+        {
+            Symbol arg_name = proto_->args()[index++];
+            AllocaInst *alloca = context.createEntryBlockAlloca(arg_name, arg.getType());
+            context.irBuilder.CreateStore(&arg, alloca);
+            context.namedValue(arg_name, alloca);
+        }
+        // codegen body然后return
+        Value *ret_val = flatBody_ ? flatBody_->CodeGen(context) : body_->CodeGen(context);
+        if (ret_val != nullptr)
+        {
+            ret_val = convertValue(context.irBuilder, ret_val, func->getReturnType());
+        }
+        if (ret_val == nullptr)
+        {
+            // body生成失败，删除不完整的函数
+            if (body_func != func)
+            {
+                body_func->eraseFromParent();
+            }
+            func->eraseFromParent();
+            return nullptr;
+        }
+        context.irBuilder.CreateRet(ret_val);
+        if (body_func != func)
+        {
+            emitMemoCache(context, func, body_func);
+        }
+        {
+            PhaseScope verify_scope(PHASE_VERIFY);
+            verifyFunction(*body_func);
+            verifyFunction(*func);
+        }
+        // 优化生成的函数
+        {
+            PhaseScope optimize_scope(PHASE_OPTIMIZE);
+            if (body_func != func)
+            {
+                context.passManager->run(*body_func);
+            }
+            context.passManager->run(*func);
+        }
+        // 顶层表达式只执行一次, 不计数
+        if (g_profile_functions && g_symbols.name(name) != g_anon_expr_name)
+        {
+            emitProfileCounters(context, func, true);
+            if (body_func != func)
+            {
+                emitProfileCounters(context, body_func, false);
+            }
+        }
+        return func;
+    }
+};
+
+//
+
+// 一个顶层item: 函数定义、extern声明或顶层表达式
+struct TopLevelItem
+{
+    enum Kind
+    {
+        ITEM_DEFINITION,
+        ITEM_EXTERN,
+        ITEM_EXPRESSION,
+        ITEM_ERROR, // 解析出错, 已经报错并跳过了出错的token
+        ITEM_EOF
+    };
+    Kind kind = ITEM_EOF;
+    unique_ptr<FunctionAST> func;   // ITEM_DEFINITION/ITEM_EXPRESSION
+    unique_ptr<PrototypeAST> proto; // ITEM_EXTERN
+    // PipelinedParser在解析线程中收集的错误, 由处理item的线程报告
+    vector<string> errors;
+};
+
+class Parser
+{
+public:
+    // 字符流以连续内存的形式提供给Lexer, Lexer直接按字节扫描[data(), data()+size())
+    class CharStream
+    {
+    protected:
+        const char *data_ = nullptr;
+        size_t size_ = 0;
+
+    public:
+        virtual ~CharStream() {}
+
+        const char *data() const { return data_; }
+        size_t size() const { return size_; }
+        // 读入更多字符，扩展data()/size(), 没有更多输入时返回false。
+        // 已读入的字符只追加, 只有discard()会丢弃, 但data()可能因此改变
+        virtual bool fill() { return false; }
+        // 可以丢弃最前面的count个已经解析完的字符, 返回实际丢弃的字符数,
+        // 之后data()[0]是原来的data()[返回值]。默认不丢弃
+        virtual size_t discard(size_t) { return 0; }
+    };
+
+private:
+    Symbol g_identifier_sym; // Filled in if TOKEN_IDENTIFIER
+    double g_number_val;     // Filled in if TOKEN_NUMBER
+    int g_current_token;
+    // 当前token在stream中的位置和长度
+    size_t token_offset = 0;
+    size_t token_length = 0;
+
+    int last_char = ' ';
+    // 下一个要读取的字符在stream中的位置
+    size_t pos = 0;
+
+    CharStream *stream;
+    // 当前顶层item的AST节点都分配在这里, 解析完函数后交给FunctionAST
+    unique_ptr<ASTArena> arena = make_unique<ASTArena>();
+
+    // 当前顶层item中的纯表达式节点, 相同的纯子树只创建一次。随arena一起清空
+    DenseMap<uint64_t, ExprAST *> numbers;
+    DenseMap<Symbol, ExprAST *> variables;
+    DenseMap<std::tuple<char, ExprAST *, ExprAST *>, ExprAST *> binaries;
+
+private:
+    unique_ptr<ASTArena> takeArena();
+    // 创建表达式节点。打开--simplify-ast时复用相同的纯节点, 并在创建二元操作时
+    // 自底向上化简: 折叠字面值的运算, 以及不改变结果类型和值的恒等式(x*1, x-0等)
+    ExprAST *makeNumber(double val);
+    ExprAST *makeVariable(Symbol name);
+    ExprAST *makeBinary(char op, ExprAST *lhs, ExprAST *rhs);
+
+public:
+    Parser(CharStream *stream) : stream(stream) {}
+    ~Parser() {}
+
+    StringRef identifier();
+    double number();
+    int currentToken();
+    // 当前token的原始文本, 指向stream的缓冲区, 读入更多字符后失效
+    StringRef tokenText();
+
+    int nextChar();
+    int GetToken();
+    int GetNextToken();
+    int GetTokenPrecedence();
+
+    // 丢弃当前token之前已经解析完的输入, 长时间读取流式输入时缓冲区不会无限增长。
+    // 之前tokenText()返回的StringRef随之失效
+    void releaseInput();
+
+    ExprAST *ParseNumberExpr();
+    ExprAST *ParseParenExpr();
+    ExprAST *ParseIdentifierExpr();
+    ExprAST *ParseIfExpr();
+    ExprAST *ParseForExpr();
+    ExprAST *ParseVarExpr();
+    // 解析 ':' 后的类型名, 出错时返回false
+    bool ParseTypeAnnotation(ValueType &type);
+    ExprAST *ParsePrimary();
+    ExprAST *ParseBinOpRhs(
+        int min_precedence,
+        ExprAST *lhs);
+    ExprAST *ParseExpression();
+
+    unique_ptr<PrototypeAST> ParsePrototype();
+    unique_ptr<FunctionAST> ParseDefinition();
+    unique_ptr<PrototypeAST> ParseExtern();
+    unique_ptr<FunctionAST> ParseTopLevelExpr();
+    // 解析下一个顶层item, 跳过item之间的';'。出错时跳过出错的token, 返回ITEM_ERROR。
+    // 第一次调用前先GetNextToken()读入第一个token。item以';'结束时不需要读入
+    // 下一个item的输入就能返回, 交互输入时可以立即执行
+    TopLevelItem ParseItem();
+};
+
+// 流水线解析: 后台线程解析字符流, 处理当前item的同时解析之后的item。
+// 解析时的错误随item交给next()的调用者报告, 输出顺序与串行解析相同。
+// 解析线程中的耗时不计入--time-report
+class PipelinedParser
+{
+private:
+    // 最多提前解析的item数
+    static const size_t kMaxPending = 64;
+
+    Parser parser;
+    mutex lock;
+    condition_variable ready; // 有新的item
+    condition_variable space; // 队列有空位
+    deque<TopLevelItem> items;
+    std::thread worker;
+
+    void run();
+
+public:
+    PipelinedParser(Parser::CharStream *stream);
+    // 等待解析线程读到输入结束
+    ~PipelinedParser();
+
+    // 取出下一个item, 还没有解析完时等待, 输入结束后一直返回ITEM_EOF
+    TopLevelItem next();
+};
+
+//
+
+// 文件字符流
+// 普通文件整体mmap到内存中; 管道、标准输入等无法mmap的文件按块读入缓冲区
+class FileCharStream : public Parser::CharStream
+{
+private:
+    static const size_t kBlockSize = 64 * 1024;
+
+    int fd = -1;
+    bool mapped = false;
+    vector<char> buffer;
+
+public:
+    // path为"-"时读取标准输入
+    FileCharStream(const char *path);
+
+    // 读取已经打开的fd(比如socket), 析构时关闭
+    explicit FileCharStream(int fd) : fd(fd) {}
+    ~FileCharStream();
+
+    bool isOpen() const { return fd >= 0; }
+    bool fill() override;
+    size_t discard(size_t count) override;
+};
+
+// 并行编译函数定义: 主线程解析出的定义攒成批交给线程池，每批在独立的
+// LLVMContext中生成IR并优化，然后按提交的顺序加入JIT
+class ParallelCompiler
+{
+private:
+    static const size_t kBatchSize = 32;
+
+    KaleidoscopeJIT &jit;
+    ObjectFileCache *cache;
+    shared_ptr<PrototypeTable> functionProtos;
+    DataLayout dataLayout;
+    unsigned optLevel;
+    ThreadPool pool;
+    vector<unique_ptr<FunctionAST>> pending;
+    // 已经提交的批数和已经交给JIT的批数, 各批按提交的顺序交给JIT
+    uint64_t submitted = 0;
+    uint64_t registered = 0;
+    mutex orderLock;
+    condition_variable orderChanged;
+
+    void submit();
+
+public:
+    // 每批定义在一个线程中生成IR, 每个定义各在一个module中经由addDefinition交给JIT,
+    // 可以重新定义。cache不为空时每个定义单独在缓存中查找和保存
+    ParallelCompiler(KaleidoscopeJIT &jit, shared_ptr<PrototypeTable> functionProtos,
+                     unsigned optLevel, unsigned threads, ObjectFileCache *cache = nullptr);
+    ~ParallelCompiler();
+
+    // 记录函数接口后加入待编译队列, 之后的顶层表达式即可调用它。
+    // 接口与之前记录的不同时报错并返回false, 与串行编译时相同, func被丢弃
+    bool add(unique_ptr<FunctionAST> func);
+    // 提交剩余的定义并等待所有定义加入JIT
+    void wait();
+};
+
+// 延迟编译函数定义: 记录接口后把AST交给JIT, 第一次被调用时才在独立的
+// context中生成IR并编译
+// cache不为空时生成的module以cacheKey()命名, 编译时经过对象缓存
+Error addLazyDefinition(KaleidoscopeJIT &jit, unique_ptr<FunctionAST> func,
+                        shared_ptr<PrototypeTable> functionProtos, unsigned optLevel,
+                        ObjectFileCache *cache = nullptr);
+
+class StringCharStream : public Parser::CharStream
+{
+private:
+    string source;
+
+public:
+    StringCharStream(string source) : source(move(source))
+    {
+        data_ = this->source.data();
+        size_ = this->source.size();
+    };
+    ~StringCharStream(){};
+};
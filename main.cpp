@@ -1,683 +1,782 @@
 
-#include <cstdlib>
-#include <cstring>
-#include <string>
-#include <vector>
-#include <map>
+#include <cerrno>
+#include <chrono>
 #include <iostream>
-#include <memory>
 
-using namespace std;
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
-#include "main.h"
+#include "interp.h"
 
-// 记录了LLVM的核心数据结构，比如类型和常量表，不过我们不太需要关心它的内部
-LLVMContext g_llvm_context;
-// 用于创建LLVM指令
-IRBuilder<> g_ir_builder(g_llvm_context);
-// 用于管理函数和全局变量，可以粗浅地理解为类c++的编译单元(单个cpp文件)
-Module g_module("my cool jit", g_llvm_context);
-// 用于记录函数的变量参数
-map<string, Value *> g_named_values;
-
-class ASTContext
+// 替换全局operator new, 为--time-report统计内存分配次数。
+// LLVM以-fno-exceptions编译, 不能抛出bad_alloc: 与标准库相同先调用new_handler, 没有时报错退出
+void *operator new(size_t size)
 {
-public:
-    LLVMContext llvmContext;
-    IRBuilder<> irBuilder;
-    Module module;
-    map<string, Value *> namedValues;
-
-public:
-    Value *doubleValue(double v)
-    {
-        return ConstantFP::get(llvmContext, APFloat(v));
-    }
-    Value *namedValue(string name)
-    {
-        return namedValues.at(name);
-    }
-    void namedValue(string name, Value *value)
+    allocationCount().fetch_add(1, memory_order_relaxed);
+    while (true)
     {
-        namedValues[name] = value;
+        if (void *ptr = malloc(size ? size : 1))
+        {
+            return ptr;
+        }
+        new_handler handler = get_new_handler();
+        if (handler == nullptr)
+        {
+            report_bad_alloc_error("kal: out of memory");
+        }
+        handler();
     }
-    void namedClear()
+}
+
+// 不内联: 否则GCC在内联后看到new得到的指针被free, 误报-Wmismatched-new-delete
+LLVM_ATTRIBUTE_NOINLINE void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+LLVM_ATTRIBUTE_NOINLINE void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+cl::opt<bool> g_dump_ir("dump-ir", cl::desc("Print the IR of every generated function"),
+                        cl::cat(g_kal_category));
+
+void testGetToken()
+{
+    cout << "===============================" << endl;
+    FileCharStream stream("sample-1.txt");
+    Parser parser(&stream);
+    int e;
+    while (true)
     {
-        namedValues.clear();
+        e = parser.GetNextToken();
+        if (e == TOKEN_DEF)
+        {
+            printf("定义函数: \n");
+        }
+        else if (e == TOKEN_EXTERN)
+        {
+            printf("导出函数: \n");
+        }
+        else if (e == TOKEN_IDENTIFIER)
+        {
+            printf("identifier: %s\n", parser.identifier().str().c_str());
+        }
+        else if (e == TOKEN_NUMBER)
+        {
+            printf("number: %.1f\n", parser.number());
+        }
+        else if (e == TOKEN_EOF)
+        {
+            printf("结束\n");
+            break;
+        }
     }
-};
+}
 
-//
+ExitOnError exitOnErr;
 
-#ifndef __cpp_lib_make_unique
-template <typename T, typename... Ts>
-unique_ptr<T> make_unique(Ts &&...params)
+void dumpIR(Function *func)
 {
-    return unique_ptr<T>(new T(forward<Ts>(params)...));
+    if (g_dump_ir)
+    {
+        func->print(traceStream());
+        traceStream() << '\n';
+    }
 }
-#endif
 
-//
+cl::opt<string> g_input_file(cl::Positional, cl::desc("<input file, - for stdin>"),
+                             cl::init("sample-2.txt"), cl::cat(g_kal_category));
 
-// 定义优先级
-const map<char, int> g_binop_precedence = {
-    {'<', 10}, {'+', 20}, {'-', 20}, {'*', 40}};
+cl::opt<unsigned> g_listen("listen", cl::desc("Serve the REPL on 127.0.0.1:<port>, one connection at a time"),
+                          cl::value_desc("port"), cl::init(0), cl::cat(g_kal_category));
 
-// 如果不是以下5种情况，Lexer返回[0-255]的ASCII值，否则返回以下枚举值
-enum Token
-{
-    TOKEN_EOF = -1,        // 文件结束标识符
-    TOKEN_DEF = -2,        // 关键字def
-    TOKEN_EXTERN = -3,     // 关键字extern
-    TOKEN_IDENTIFIER = -4, // 名字
-    TOKEN_NUMBER = -5      // 数值
-};
+cl::opt<bool> g_pipeline("pipeline", cl::desc("Parse the next top-level item on a background thread "
+                                              "(always on for stdin and --listen)"),
+                         cl::cat(g_kal_category));
 
-//
+cl::opt<bool> g_flat_ast("flat-ast", cl::desc("Lower function bodies through the flat AST encoding"),
+                          cl::cat(g_kal_category));
 
-// 所有 `表达式` 节点的基类
-class ExprAST
-{
+cl::opt<bool> g_time_report("time-report", cl::desc("Print time and allocations spent in each phase at exit"),
+                             cl::cat(g_kal_category));
 
-protected:
-    ASTContext &context;
+cl::opt<char> g_opt_level("O", cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] (default = '-O2')"),
+                          cl::Prefix, cl::init('2'), cl::cat(g_kal_category));
 
-public:
-    ExprAST(ASTContext &context) : context(context) {}
+cl::opt<unsigned> g_compile_threads("compile-threads",
+                                     cl::desc("Compile function definitions on N worker threads (0 = serial)"),
+                                     cl::init(0), cl::cat(g_kal_category));
 
-    virtual ~ExprAST() {}
-    virtual Value *CodeGen() = 0;
-};
+cl::opt<bool> g_lazy("lazy", cl::desc("Keep function definitions as AST until they are first called"),
+                     cl::cat(g_kal_category));
 
-// 字面值表达式
-class NumberExprAST : public ExprAST
-{
-private:
-    double val_;
+cl::opt<bool> g_tier("tier", cl::desc("Interpret function definitions and top-level expressions first, "
+                                      "JIT-compile hot functions"),
+                     cl::cat(g_kal_category));
 
-public:
-    NumberExprAST(ASTContext &context, double val) : ExprAST(context), val_(val) {}
-    Value *CodeGen() override
-    {
-        return context.doubleValue(val_);
-    }
-};
+cl::opt<unsigned> g_tier_threshold("tier-threshold",
+                                   cl::desc("Calls plus loop iterations after which --tier JIT-compiles a function"),
+                                   cl::init(1000), cl::cat(g_kal_category));
+
+cl::opt<string> g_cache_dir("cache-dir", cl::desc("Cache compiled function definitions as object files in <dir>"),
+                            cl::value_desc("dir"), cl::cat(g_kal_category));
 
-// 变量表达式
-class VariableExprAST : public ExprAST
+cl::opt<unsigned> g_exec_threads("exec-threads",
+                                 cl::desc("Run independent top-level expressions on N threads, printing results "
+                                          "in source order (ignored with --tier)"),
+                                 cl::init(0), cl::cat(g_kal_category));
+
+cl::opt<bool> g_perf_map("perf-map", cl::desc("Write JIT-compiled functions to /tmp/perf-<pid>.map for perf"),
+                         cl::cat(g_kal_category));
+
+cl::opt<bool> g_jitdump("jitdump", cl::desc("Write a perf jitdump file (in $JITDUMPDIR or ~/.debug/jit) "
+                                            "for perf inject --jit"),
+                        cl::cat(g_kal_category));
+
+cl::opt<bool> g_gdb_jit("gdb-jit", cl::desc("Register JIT-compiled code with the GDB JIT interface"),
+                        cl::cat(g_kal_category));
+
+// --exec-threads: 顶层表达式编译后交给线程池执行, 结果按源码顺序输出。
+// 记录每个函数定义直接调用的函数, 表达式的依赖是调用关系的传递闭包。依赖中只有函数定义和
+// libm数学函数的表达式是纯计算, 与其他表达式同时执行; 调用了其他extern(可能有输出等副作用)的
+// 表达式等之前的表达式都执行完后在主线程中执行。重新定义函数之前等待依赖它的表达式执行完,
+// 所以输出与依次执行时相同
+class ParallelEvaluator
 {
 private:
-    string name_;
+    struct Pending
+    {
+        KaleidoscopeJIT::Expression expr;
+        DenseSet<Symbol> dependencies;
+        shared_future<void> done;
+        double result = 0;
+    };
 
-public:
-    VariableExprAST(ASTContext &context, const string &name) : ExprAST(context), name_(name) {}
-    Value *CodeGen() override
+    KaleidoscopeJIT &jit;
+    shared_ptr<PrototypeTable> functionProtos;
+    ThreadPool pool;
+    // 每个函数定义直接调用的函数
+    DenseMap<Symbol, SmallVector<Symbol, 4>> callees;
+    // 按源码顺序排列, 还没有输出结果的表达式。线程池中的任务持有元素的指针, 只在两端增删
+    deque<Pending> pending;
+    unsigned count = 0;
+
+    // 求func调用关系的传递闭包, 其中有函数定义和libm数学函数以外的函数时返回false
+    bool collect(const FunctionAST &func, DenseSet<Symbol> &result) const
     {
-        return context.namedValue(name_);
+        SmallVector<Symbol, 16> worklist;
+        func.callees(worklist);
+        bool pure = true;
+        while (!worklist.empty())
+        {
+            Symbol name = worklist.pop_back_val();
+            if (!result.insert(name).second)
+            {
+                continue;
+            }
+            auto it = callees.find(name);
+            if (it != callees.end())
+            {
+                worklist.append(it->second.begin(), it->second.end());
+            }
+            else if (!functionProtos->isMathFunction(name))
+            {
+                pure = false;
+            }
+        }
+        return pure;
     }
-};
 
-// 二元操作表达式
-class BinaryExprAST : public ExprAST
-{
-private:
-    char op_;
-    unique_ptr<ExprAST> lhs_;
-    unique_ptr<ExprAST> rhs_;
+    void print(Pending &item)
+    {
+        cout << "evaluated to " << item.result << '\n';
+        if (Error err = jit.release(item.expr))
+        {
+            logAllUnhandledErrors(move(err), errs(), "Error: ");
+        }
+    }
 
 public:
-    BinaryExprAST(ASTContext &context, char op, unique_ptr<ExprAST> lhs,
-                  unique_ptr<ExprAST> rhs)
-        : ExprAST(context), op_(op), lhs_(move(lhs)), rhs_(move(rhs)) {}
+    ParallelEvaluator(KaleidoscopeJIT &jit, shared_ptr<PrototypeTable> functionProtos, unsigned threads)
+        : jit(jit), functionProtos(move(functionProtos)), pool(hardware_concurrency(threads)) {}
 
-    Value *CodeGen() override
+    ~ParallelEvaluator()
     {
-        Value *lhs = lhs_->CodeGen();
-        Value *rhs = rhs_->CodeGen();
-        switch (op_)
+        flush(true);
+    }
+
+    // 等待依赖函数name的表达式执行完, 在name的新定义交给JIT之前调用
+    void waitFor(Symbol name)
+    {
+        for (Pending &item : pending)
         {
-        case '<':
+            if (item.dependencies.count(name))
+            {
+                item.done.wait();
+            }
+        }
+    }
+    // 记录函数name的新定义直接调用的函数
+    void setCallees(Symbol name, ArrayRef<Symbol> list)
+    {
+        callees[name].assign(list.begin(), list.end());
+    }
+    // 记录函数定义的调用关系, 在定义交给JIT之前调用
+    void define(const FunctionAST &func)
+    {
+        waitFor(func.name());
+        SmallVector<Symbol, 4> list;
+        func.callees(list);
+        setCallees(func.name(), list);
+    }
+
+    // 执行顶层表达式ast, func是它在context.module中生成的函数, module随之交给JIT
+    void evaluate(const FunctionAST &ast, Function *func, ASTContext &context)
+    {
+        // 多个顶层表达式同时存在于JIT中, 函数名不能相同
+        string name = (g_anon_expr_name + "." + Twine(++count)).str();
+        func->setName(name);
+        Pending item;
+        bool pure = collect(ast, item.dependencies);
+        auto expr = jit.compileExpression(context.takeModule(), name);
+        if (!expr)
         {
-            Value *tmp = context.irBuilder.CreateFCmpULT(lhs, rhs, "cmptmp");
-            // 把 0/1 转为 0.0/1.0
-            return context.irBuilder.CreateUIToFP(
-                tmp, Type::getDoubleTy(context.llvmContext), "booltmp");
+            flush(true);
+            logAllUnhandledErrors(expr.takeError(), errs(), "Error: ");
+            return;
         }
-        case '+':
-            return context.irBuilder.CreateFAdd(lhs, rhs, "addtmp");
-        case '-':
-            return context.irBuilder.CreateFSub(lhs, rhs, "subtmp");
-        case '*':
-            return context.irBuilder.CreateFMul(lhs, rhs, "multmp");
-        default:
-            return nullptr;
+        item.expr = *expr;
+        if (!pure)
+        {
+            flush(true);
+            item.result = item.expr.func();
+            print(item);
+            return;
         }
+        pending.push_back(move(item));
+        Pending *slot = &pending.back();
+        slot->done = pool.async([slot]()
+                                { slot->result = slot->expr.func(); });
     }
-};
 
-// 函数调用表达式
-class CallExprAST : public ExprAST
-{
-private:
-    string callee_;
-    vector<unique_ptr<ExprAST>> args_;
-
-public:
-    CallExprAST(ASTContext &context,
-                const string &callee,
-                vector<unique_ptr<ExprAST>> args)
-        : ExprAST(context), callee_(callee), args_(move(args)) {}
-    Value *CodeGen() override
+    // 按顺序输出已经执行完的表达式的结果, wait时等待所有表达式执行完
+    void flush(bool wait)
     {
-        Function *callee = context.module.getFunction(callee_);
-        vector<Value *> args;
-        for (unique_ptr<ExprAST> &argExpr : args_)
+        while (!pending.empty())
         {
-            args.push_back(argExpr->CodeGen());
+            Pending &item = pending.front();
+            if (!wait && item.done.wait_for(chrono::seconds(0)) != future_status::ready)
+            {
+                break;
+            }
+            item.done.wait();
+            print(item);
+            pending.pop_front();
         }
-        return context.irBuilder.CreateCall(callee, args, "calltmp");
     }
 };
 
-// 函数接口
-class PrototypeAST
+// testExpr的输入: 输入文件(或标准输入), 或者--listen时依次接受的连接
+class InputSource
 {
 private:
-    ASTContext &context;
-    string name_;
-    vector<string> args_;
+    unique_ptr<FileCharStream> file;
+    int listenFd = -1;
+    // 处理连接期间标准输出和标准错误重定向到该连接, 结束后恢复
+    int savedStdout = -1;
+    int savedStderr = -1;
 
 public:
-    PrototypeAST(ASTContext &context, const string &name, vector<string> args)
-        : context(context), name_(name), args_(move(args)) {}
-    const string &name() const { return name_; }
-
-    Function *CodeGen()
+    ~InputSource()
     {
-        // 创建kaleidoscope的函数类型 double (doube, double, ..., double)
-        vector<Type *> doubles(args_.size(), Type::getDoubleTy(g_llvm_context));
-        // 函数类型是唯一的，所以使用get而不是new/create
-        FunctionType *function_type = FunctionType::get(Type::getDoubleTy(g_llvm_context), doubles, false);
-        // 创建函数, ExternalLinkage意味着函数可能不在当前module中定义，在当前module
-        // 即g_module中注册名字为name_, 后面可以使用这个名字在g_module中查询
-        Function *func = Function::Create(
-            function_type, Function::ExternalLinkage, name_, &g_module);
-        // 增加IR可读性，设置function的argument name
-        int index = 0;
-        for (auto &arg : func->args())
+        if (listenFd >= 0)
         {
-            arg.setName(args_[index++]);
+            close(listenFd);
+            close(savedStdout);
+            close(savedStderr);
         }
-        return func;
     }
-};
-
-// 函数
-class FunctionAST
-{
-private:
-    ASTContext &context;
-    unique_ptr<PrototypeAST> proto_;
-    unique_ptr<ExprAST> body_;
 
-public:
-    FunctionAST(ASTContext &context,
-                unique_ptr<PrototypeAST> proto,
-                unique_ptr<ExprAST> body)
-        : context(context), proto_(move(proto)), body_(move(body)) {}
+    // 打开输入文件, path为"-"时读取标准输入
+    bool open(const string &path)
+    {
+        file = make_unique<FileCharStream>(path.c_str());
+        return file->isOpen();
+    }
 
-    Value *CodeGen()
+    // 在127.0.0.1:port上监听, 之后next()依次接受连接
+    bool listen(unsigned port)
     {
-        // 检查函数声明是否已完成codegen(比如之前的extern声明), 如果没有则执行codegen
-        Function *func = context.module.getFunction(proto_->name());
-        if (func == nullptr)
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenFd < 0)
         {
-            func = proto_->CodeGen();
+            perror("socket");
+            return false;
         }
-        // 创建一个Block并且设置为指令插入位置。
-        // llvm block用于定义control flow graph, 由于我们暂不实现control flow, 创建
-        // 一个单独的block即可
-        BasicBlock *block = BasicBlock::Create(g_llvm_context, "entry", func);
-        context.irBuilder.SetInsertPoint(block);
-        // 将函数参数注册到context.namedValues中，让VariableExprAST可以codegen
-        context.namedClear();
-        for (Value &arg : func->args())
+        int reuse = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+            ::listen(listenFd, 1) < 0)
         {
-            context.namedValue(arg.getName().str(), &arg);
+            perror("listen");
+            return false;
         }
-        // codegen body然后return
-        Value *ret_val = body_->CodeGen();
-        context.irBuilder.CreateRet(ret_val);
-        verifyFunction(*func);
-        return func;
+        savedStdout = dup(STDOUT_FILENO);
+        savedStderr = dup(STDERR_FILENO);
+        return true;
     }
-};
-
-//
-
-class Parser
-{
-public:
-    class CharStream
-    {
-    public:
-        virtual int next() = 0;
-    };
-
-private:
-    string g_identifier_str; // Filled in if TOKEN_IDENTIFIER
-    double g_number_val;     // Filled in if TOKEN_NUMBER
-    int g_current_token;
-
-    int last_char = ' ';
-
-    CharStream *stream;
-
-private:
-public:
-    Parser(CharStream *stream) : stream(stream) {}
-    ~Parser() {}
-
-    string identifier();
-    double number();
-    int currentToken();
-
-    int nextChar();
-    int GetToken();
-    int GetNextToken();
-    int GetTokenPrecedence();
-
-    unique_ptr<ExprAST> ParseNumberExpr();
-    unique_ptr<ExprAST> ParseParenExpr();
-    unique_ptr<ExprAST> ParseIdentifierExpr();
-    unique_ptr<ExprAST> ParsePrimary();
-    unique_ptr<ExprAST> ParseBinOpRhs(
-        int min_precedence,
-        unique_ptr<ExprAST> lhs);
-    unique_ptr<ExprAST> ParseExpression();
-
-    unique_ptr<PrototypeAST> ParsePrototype();
-    unique_ptr<FunctionAST> ParseDefinition();
-    unique_ptr<PrototypeAST> ParseExtern();
-    unique_ptr<FunctionAST> ParseTopLevelExpr();
-};
-
-string Parser::identifier()
-{
-    return move(g_identifier_str);
-}
-
-double Parser::number()
-{
-    return g_number_val;
-}
 
-int Parser::nextChar()
-{
-    return last_char = stream->next();
-}
-
-int Parser::GetToken()
-{
-    // 忽略空白字符
-    while (isspace(last_char))
+    // 标准输入或连接: 在后台解析之后的item, 每个item处理完立即输出
+    bool streaming() const
     {
-        nextChar();
+        return listenFd >= 0 || g_input_file == "-";
     }
-    // 识别字符串
-    if (isalpha(last_char))
+
+    // 下一段输入, 没有更多输入时返回nullptr
+    unique_ptr<FileCharStream> next()
     {
-        g_identifier_str = last_char;
-        while (isalnum((nextChar())))
+        if (listenFd < 0)
         {
-            g_identifier_str += last_char;
+            return move(file);
         }
-        if (g_identifier_str == "def")
+        int fd;
+        do
         {
-            return TOKEN_DEF;
-        }
-        else if (g_identifier_str == "extern")
+            fd = accept(listenFd, nullptr, nullptr);
+        } while (fd < 0 && errno == EINTR);
+        if (fd < 0)
         {
-            return TOKEN_EXTERN;
+            perror("accept");
+            return nullptr;
         }
-        else
+        cout.flush();
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        return make_unique<FileCharStream>(fd);
+    }
+
+    // next()返回的输入处理完毕, 连接的输出随之结束
+    void finish()
+    {
+        if (listenFd >= 0)
         {
-            return TOKEN_IDENTIFIER;
+            cout.flush();
+            dup2(savedStdout, STDOUT_FILENO);
+            dup2(savedStderr, STDERR_FILENO);
         }
     }
-    // 识别数值
-    if (isdigit(last_char) || last_char == '.')
+};
+
+void testExpr(InputSource &input, unsigned optLevel)
+{
+    cout << "===============================" << endl;
+    // cache必须比jit后析构
+    unique_ptr<ObjectFileCache> cache;
+    if (!g_cache_dir.empty())
     {
-        string num_str;
-        do
-        {
-            num_str += last_char;
-            nextChar();
-        } while (isdigit(last_char) || last_char == '.');
-        g_number_val = strtod(num_str.c_str(), nullptr);
-        return TOKEN_NUMBER;
+        cache = make_unique<ObjectFileCache>(g_cache_dir);
     }
-    // 忽略注释
-    if (last_char == '#')
+    // 同样必须比jit后析构
+    unique_ptr<PerfMapListener> perfMap;
+    // 并发执行的表达式第一次调用函数时在各自的线程中编译函数体, JIT的编译器必须是线程安全的,
+    // 至少要有一个编译线程
+    bool parallel_exec = g_exec_threads > 0 && !g_tier;
+    unsigned jit_threads = parallel_exec ? max(1u, (unsigned)g_compile_threads) : (unsigned)g_compile_threads;
+    auto jit = exitOnErr(KaleidoscopeJIT::Create(jit_threads, cache.get()));
+    // 让perf和GDB能把JIT代码的地址解析为函数名(函数体为name.body)
+    if (g_perf_map)
     {
-        do
-        {
-            nextChar();
-        } while (last_char != EOF && last_char != '\n' && last_char != '\r');
-        if (last_char != EOF)
+        perfMap = make_unique<PerfMapListener>();
+        exitOnErr(jit->addEventListener(*perfMap));
+    }
+    if (g_jitdump)
+    {
+        JITEventListener *listener = JITEventListener::createPerfJITEventListener();
+        if (listener == nullptr)
         {
-            return GetToken();
+            exitOnErr(make_error<StringError>("--jitdump is not supported by this LLVM build",
+                                              inconvertibleErrorCode()));
         }
+        exitOnErr(jit->addEventListener(*listener));
     }
-    // 识别文件结束
-    if (last_char == EOF)
+    if (g_gdb_jit)
     {
-        return TOKEN_EOF;
+        exitOnErr(jit->addEventListener(*JITEventListener::createGDBRegistrationListener()));
     }
-    // 直接返回ASCII
-    int this_char = last_char;
-    nextChar();
-    return this_char;
-}
-
-int Parser::GetNextToken()
-{
-    return g_current_token = GetToken();
-}
-int Parser::currentToken()
-{
-    return g_current_token;
-}
-
-int Parser::GetTokenPrecedence()
-{
-    auto it = g_binop_precedence.find(g_current_token);
-    if (it != g_binop_precedence.end())
+    auto targetMachine = exitOnErr(jit->createTargetMachine());
+    ASTContext context(jit->dataLayout(), optLevel, make_shared<PrototypeTable>(), targetMachine.get());
+    // 分层执行时函数定义由解释器执行, 同时惰性地交给JIT
+    unique_ptr<Interpreter> interpreter;
+    if (g_tier)
     {
-        return it->second;
+        interpreter = make_unique<Interpreter>(*jit, context.functionProtos, g_tier_threshold);
     }
-    else
+    // 并行模式下函数定义交给compiler, 主线程只处理extern和顶层表达式
+    unique_ptr<ParallelCompiler> compiler;
+    if (g_compile_threads > 0 && !g_tier)
     {
-        return -1;
+        compiler = make_unique<ParallelCompiler>(*jit, context.functionProtos, optLevel, g_compile_threads,
+                                                 cache.get());
     }
-}
-
-unique_ptr<ExprAST> Parser::ParseNumberExpr()
-{
-    auto result = make_unique<NumberExprAST>(g_number_val);
-    GetNextToken();
-    return move(result);
-}
-
-// parenexpr ::= ( expression )
-unique_ptr<ExprAST> Parser::ParseParenExpr()
-{
-    GetNextToken(); // eat (
-    auto expr = ParseExpression();
-    GetNextToken(); // eat )
-    return expr;
-}
-
-/// identifierexpr
-///   ::= identifier
-///   ::= identifier ( expression, expression, ..., expression )
-unique_ptr<ExprAST> Parser::ParseIdentifierExpr()
-{
-    string id = g_identifier_str;
-    GetNextToken();
-    if (g_current_token != '(')
+    unique_ptr<ParallelEvaluator> evaluator;
+    if (parallel_exec)
     {
-        return make_unique<VariableExprAST>(id);
+        evaluator = make_unique<ParallelEvaluator>(*jit, context.functionProtos, g_exec_threads);
     }
-    else
+    PhaseProfiler &profiler = PhaseProfiler::instance();
+    unsigned expr_index = 0;
+    // 函数定义等状态在各段输入之间保留
+    while (auto stream = input.next())
     {
-        GetNextToken(); // eat (
-        vector<unique_ptr<ExprAST>> args;
-        while (g_current_token != ')')
+        unique_ptr<Parser> parser;
+        unique_ptr<PipelinedParser> pipeline;
+        if (g_pipeline || input.streaming())
+        {
+            pipeline = make_unique<PipelinedParser>(stream.get());
+        }
+        else
+        {
+            parser = make_unique<Parser>(stream.get());
+            parser->GetNextToken();
+        }
+        while (true)
         {
-            args.push_back(ParseExpression());
-            if (g_current_token == ')')
+            TopLevelItem item = pipeline ? pipeline->next() : parser->ParseItem();
+            for (auto &message : item.errors)
+            {
+                LogError(message.c_str());
+            }
+            if (item.kind == TopLevelItem::ITEM_EOF)
+            {
+                break;
+            }
+            switch (item.kind)
+            {
+            case TopLevelItem::ITEM_DEFINITION:
+            {
+                unique_ptr<FunctionAST> ast = move(item.func);
+                TRACE_PARSE("parsed a function definition");
+                // 解释器翻译树形的AST, 要在flatten()之前
+                if (interpreter && interpreter->addFunction(*ast) == Interpreter::INTERP_FAILED)
+                {
+                    profiler.endItem(g_symbols.name(ast->name()));
+                    break;
+                }
+                if (g_flat_ast)
+                {
+                    ast->flatten();
+                }
+                if (g_lazy || interpreter)
+                {
+                    if (evaluator)
+                    {
+                        evaluator->define(*ast);
+                    }
+                    Symbol name = ast->name();
+                    if (Error err = addLazyDefinition(*jit, move(ast), context.functionProtos, optLevel, cache.get()))
+                    {
+                        logAllUnhandledErrors(move(err), errs(), "Error: ");
+                    }
+                    profiler.endItem(g_symbols.name(name));
+                    break;
+                }
+                if (compiler)
+                {
+                    Symbol name = ast->name();
+                    profiler.endItem(g_symbols.name(name));
+                    // ast交给compiler之后就不能再用了, 先取出调用关系
+                    SmallVector<Symbol, 4> callees;
+                    if (evaluator)
+                    {
+                        ast->callees(callees);
+                        evaluator->waitFor(name);
+                    }
+                    // 与串行编译相同, 接口与之前的声明不同时add已经报错, 跳过这个定义
+                    if (compiler->add(move(ast)) && evaluator)
+                    {
+                        evaluator->setCallees(name, callees);
+                    }
+                    break;
+                }
+                if (cache)
+                {
+                    // 命中缓存时跳过IR生成、优化和编译, 直接加载目标文件
+                    string key = ast->cacheKey(jit->targetKey(), optLevel);
+                    if (auto object = cache->load(key))
+                    {
+                        if (context.functionProtos->define(ast->proto()))
+                        {
+                            if (evaluator)
+                            {
+                                evaluator->define(*ast);
+                            }
+                            if (Error err = jit->addDefinitionObject(g_symbols.name(ast->name()), move(object)))
+                            {
+                                logAllUnhandledErrors(move(err), errs(), "Error: ");
+                            }
+                        }
+                        profiler.endItem(g_symbols.name(ast->name()));
+                        break;
+                    }
+                    context.module->setModuleIdentifier(key);
+                }
+                if (Function *func = ast->CodeGen(context))
+                {
+                    if (evaluator)
+                    {
+                        evaluator->define(*ast);
+                    }
+                    dumpIR(func);
+                    // 函数定义所在的module常驻JIT，供后续调用。每个定义一个module,
+                    // 重新定义时只替换这一个函数。JIT在函数第一次被调用时才编译, module以cacheKey命名,
+                    // 编译出的目标文件由ObjectFileCache::notifyObjectCompiled写入缓存。
+                    // 不能在定义时立即编译: 函数体可能调用只有extern声明、之后才定义的函数
+                    if (Error err = jit->addDefinition(g_symbols.name(ast->name()), context.takeModule()))
+                    {
+                        logAllUnhandledErrors(move(err), errs(), "Error: ");
+                    }
+                }
+                profiler.endItem(g_symbols.name(ast->name()));
+                break;
+            }
+            case TopLevelItem::ITEM_EXTERN:
             {
+                unique_ptr<PrototypeAST> ast = move(item.proto);
+                TRACE_PARSE("parsed a extern");
+                dumpIR(ast->CodeGen(context));
+                profiler.endItem("extern " + g_symbols.name(ast->name()));
+                context.functionProtos->addExtern(*ast);
+                break;
+            }
+            case TopLevelItem::ITEM_EXPRESSION:
+            {
+                unique_ptr<FunctionAST> ast = move(item.func);
+                TRACE_PARSE("parsed a top level expr");
+                if (interpreter)
+                {
+                    double result;
+                    Interpreter::Status status = interpreter->run(*ast, result);
+                    if (status == Interpreter::INTERP_OK)
+                    {
+                        cout << "evaluated to " << result << '\n';
+                    }
+                    if (status != Interpreter::INTERP_UNSUPPORTED)
+                    {
+                        profiler.endItem("expr #" + Twine(++expr_index));
+                        break;
+                    }
+                }
+                if (g_flat_ast)
+                {
+                    ast->flatten();
+                }
+                // 表达式可能调用任意已定义的函数, 先等所有定义编译完
+                if (compiler)
+                {
+                    compiler->wait();
+                }
+                if (Function *func = ast->CodeGen(context))
+                {
+                    dumpIR(func);
+                    if (evaluator)
+                    {
+                        evaluator->evaluate(*ast, func, context);
+                        profiler.endItem("expr #" + Twine(++expr_index));
+                        break;
+                    }
+                    // 编译执行匿名函数，执行完后释放它所在的module
+                    auto result = jit->evaluate(context.takeModule(), g_anon_expr_name);
+                    if (result)
+                    {
+                        cout << "evaluated to " << *result << '\n';
+                    }
+                    else
+                    {
+                        logAllUnhandledErrors(result.takeError(), errs(), "Error: ");
+                    }
+                }
+                profiler.endItem("expr #" + Twine(++expr_index));
+                break;
+            }
+            default:
+                // 解析出错, 已经报错并跳过了出错的token
                 break;
             }
-            else
+            if (evaluator)
             {
-                GetNextToken(); // eat ,
+                evaluator->flush(false);
+            }
+            if (pipeline)
+            {
+                cout.flush();
             }
         }
-        GetNextToken(); // eat )
-        return make_unique<CallExprAST>(id, move(args));
-    }
-}
-
-/// primary
-///   ::= identifierexpr
-///   ::= numberexpr
-///   ::= parenexpr
-unique_ptr<ExprAST> Parser::ParsePrimary()
-{
-    switch (g_current_token)
-    {
-    case TOKEN_IDENTIFIER:
-        return ParseIdentifierExpr();
-    case TOKEN_NUMBER:
-        return ParseNumberExpr();
-    case '(':
-        return ParseParenExpr();
-    default:
-        return nullptr;
-    }
-}
-
-unique_ptr<ExprAST> Parser::ParseBinOpRhs(
-    int min_precedence,
-    unique_ptr<ExprAST> lhs)
-{
-    while (true)
-    {
-        int current_precedence = GetTokenPrecedence();
-        if (current_precedence < min_precedence)
+        if (compiler)
         {
-            // 如果当前token不是二元操作符，current_precedence为-1, 结束任务
-            // 如果遇到优先级更低的操作符，也结束任务
-            return lhs;
+            compiler->wait();
         }
-        int binop = g_current_token;
-        cout << "binop: " << (char)binop << endl;
-        GetNextToken(); // eat binop
-        auto rhs = ParsePrimary();
-        // 现在我们有两种可能的解析方式
-        //    * (lhs binop rhs) binop unparsed
-        //    * lhs binop (rhs binop unparsed)
-        int next_precedence = GetTokenPrecedence();
-        if (current_precedence < next_precedence)
+        if (evaluator)
         {
-            // 将高于current_precedence的右边的操作符处理掉返回
-            rhs = ParseBinOpRhs(current_precedence + 1, move(rhs));
+            evaluator->flush(true);
         }
-        lhs = make_unique<BinaryExprAST>(binop, move(lhs), move(rhs));
-        // 继续循环
-    }
-}
-
-// expression
-//   ::= primary [binop primary] [binop primary] ...
-unique_ptr<ExprAST> Parser::ParseExpression()
-{
-    auto lhs = ParsePrimary();
-    return ParseBinOpRhs(0, move(lhs));
-}
-
-// prototype
-//   ::= id ( id id ... id)
-unique_ptr<PrototypeAST> Parser::ParsePrototype()
-{
-    string function_name = g_identifier_str;
-    GetNextToken();
-    vector<string> arg_names;
-    while (GetNextToken() == TOKEN_IDENTIFIER)
-    {
-        arg_names.push_back(g_identifier_str);
+        input.finish();
     }
-    GetNextToken(); // eat )
-    return make_unique<PrototypeAST>(function_name, move(arg_names));
-}
-
-// definition ::= def prototype expression
-unique_ptr<FunctionAST> Parser::ParseDefinition()
-{
-    GetNextToken(); // eat def
-    auto proto = ParsePrototype();
-    auto expr = ParseExpression();
-    return make_unique<FunctionAST>(move(proto), move(expr));
-}
-
-// external ::= extern prototype
-unique_ptr<PrototypeAST> Parser::ParseExtern()
-{
-    GetNextToken(); // eat extern
-    return ParsePrototype();
-}
-
-// toplevelexpr ::= expression
-unique_ptr<FunctionAST> Parser::ParseTopLevelExpr()
-{
-    auto expr = ParseExpression();
-    auto proto = make_unique<PrototypeAST>("", vector<string>());
-    return make_unique<FunctionAST>(move(proto), move(expr));
-}
-
-//
-
-//
-//
-// 文件字符流
-class FileCharStream : public Parser::CharStream
-{
-private:
-    FILE *fp;
-
-public:
-    FileCharStream(const char *path);
-    ~FileCharStream();
-
-    int next();
-};
-
-FileCharStream::FileCharStream(const char *path)
-{
-    fp = fopen(path, "r");
 }
 
-FileCharStream::~FileCharStream()
-{
-    fclose(fp);
-}
+cl::OptionCategory g_aot_category("kal ahead-of-time compilation options");
 
-int FileCharStream::next()
-{
-    return fgetc(fp);
-}
+cl::opt<string> g_emit_obj("emit-obj", cl::desc("Compile the whole script into a native object file"),
+                           cl::value_desc("file"), cl::cat(g_aot_category));
 
-class StringCharStream : public Parser::CharStream
-{
-private:
-    string source;
-    int index = 0;
+cl::opt<string> g_emit_asm("emit-asm", cl::desc("Compile the whole script into native assembly"),
+                           cl::value_desc("file"), cl::cat(g_aot_category));
 
-public:
-    StringCharStream(string source) : source(source){};
-    ~StringCharStream(){};
+cl::opt<string> g_emit_bc("emit-bc", cl::desc("Write the optimized module as LLVM bitcode"),
+                          cl::value_desc("file"), cl::cat(g_aot_category));
 
-    int next();
-};
+cl::opt<string> g_mcpu("mcpu", cl::desc("Target CPU for --emit-obj/--emit-asm (default = native)"),
+                       cl::init("native"), cl::cat(g_aot_category));
 
-int StringCharStream::next()
+// 把整个脚本编译到一个module中并写出。函数定义和extern保持原名,
+// 第N个顶层表达式编译为double __kal_expr_N()
+int compileAOT(Parser::CharStream *stream, unsigned optLevel)
 {
-    return index < source.length() ? source.at(index++) : -1;
-}
-
-//
-
-void testGetToken()
-{
-    cout << "===============================" << endl;
-    FileCharStream stream("sample-1.txt");
-    Parser parser(&stream);
-    int e;
+    auto compiler = AOTCompiler::Create(g_mcpu, optLevel);
+    if (!compiler)
+    {
+        logAllUnhandledErrors(compiler.takeError(), errs(), "Error: ");
+        return 1;
+    }
+    ASTContext context((*compiler)->dataLayout(), optLevel, make_shared<PrototypeTable>(),
+                       &(*compiler)->targetMachine());
+    Parser parser(stream);
+    PhaseProfiler &profiler = PhaseProfiler::instance();
+    unsigned expr_index = 0;
+    parser.GetNextToken();
     while (true)
     {
-        e = parser.GetNextToken();
-        if (e == TOKEN_DEF)
-        {
-            printf("定义函数: \n");
-        }
-        else if (e == TOKEN_EXTERN)
-        {
-            printf("导出函数: \n");
-        }
-        else if (e == TOKEN_IDENTIFIER)
+        TopLevelItem item = parser.ParseItem();
+        if (item.kind == TopLevelItem::ITEM_EOF)
         {
-            printf("identifier: %s\n", parser.identifier().c_str());
+            break;
         }
-        else if (e == TOKEN_NUMBER)
+        switch (item.kind)
         {
-            printf("number: %.1f\n", parser.number());
-        }
-        else if (e == TOKEN_EOF)
+        case TopLevelItem::ITEM_DEFINITION:
         {
-            printf("结束\n");
+            auto ast = move(item.func);
+            if (Function *func = ast->CodeGen(context))
+            {
+                dumpIR(func);
+            }
+            profiler.endItem(g_symbols.name(ast->name()));
             break;
         }
-    }
-}
-
-void testExpr(Parser::CharStream *stream)
-{
-    cout << "===============================" << endl;
-    Parser parser(stream);
-    parser.GetNextToken();
-    while (true)
-    {
-        switch (parser.currentToken())
-        {
-        case TOKEN_EOF:
-            return;
-        case TOKEN_DEF:
+        case TopLevelItem::ITEM_EXTERN:
         {
-            auto ast = parser.ParseDefinition();
-            cout << "parsed a function definition" << endl;
-            ast->CodeGen()->print(llvm::errs());
-            std::cerr << std::endl;
+            auto ast = move(item.proto);
+            dumpIR(ast->CodeGen(context));
+            profiler.endItem("extern " + g_symbols.name(ast->name()));
+            context.functionProtos->addExtern(*ast);
             break;
         }
-        case TOKEN_EXTERN:
+        case TopLevelItem::ITEM_EXPRESSION:
         {
-            auto ast = parser.ParseExtern();
-            cout << "parsed a extern" << endl;
-            ast->CodeGen()->print(llvm::errs());
-            std::cerr << std::endl;
+            auto ast = move(item.func);
+            expr_index++;
+            if (Function *func = ast->CodeGen(context))
+            {
+                // 顶层表达式都叫g_anon_expr_name, 改名后才能放进同一个module
+                func->setName("__kal_expr_" + Twine(expr_index));
+                dumpIR(func);
+            }
+            profiler.endItem("expr #" + Twine(expr_index));
             break;
         }
         default:
-        {
-            auto ast = parser.ParseTopLevelExpr();
-            cout << "parsed a top level expr" << endl;
-            ast->CodeGen()->print(llvm::errs());
-            std::cerr << std::endl;
             break;
         }
+    }
+
+    // 整个脚本在一个module中, 定义之间可以内联
+    context.optimizeModule();
+    PhaseScope scope(PHASE_JIT);
+    const pair<const cl::opt<string> *, AOTCompiler::FileType> outputs[] = {
+        {&g_emit_bc, AOTCompiler::FILE_BITCODE},
+        {&g_emit_asm, AOTCompiler::FILE_ASSEMBLY},
+        {&g_emit_obj, AOTCompiler::FILE_OBJECT},
+    };
+    for (auto &output : outputs)
+    {
+        if (!output.first->empty())
+        {
+            if (Error err = (*compiler)->emit(*context.module, *output.first, output.second))
+            {
+                logAllUnhandledErrors(move(err), errs(), "Error: ");
+                return 1;
+            }
         }
     }
-    return;
+    return 0;
 }
 
 int main(int argc, char const *argv[])
 {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+
+    cl::HideUnrelatedOptions({&g_kal_category, &g_aot_category});
+    cl::ParseCommandLineOptions(argc, argv, "kaleidoscope JIT\n");
+    if (g_opt_level < '0' || g_opt_level > '3')
+    {
+        errs() << argv[0] << ": invalid optimization level -O" << g_opt_level << "\n";
+        return 1;
+    }
 
     // testGetToken();
-    testExpr(new FileCharStream("sample-2.txt"));
+    InputSource input;
+    if (g_listen > 0 ? !input.listen(g_listen) : !input.open(g_input_file))
+    {
+        return 1;
+    }
+    if (g_time_report)
+    {
+        PhaseProfiler::instance().enable();
+    }
+    int status = 0;
+    if (!g_emit_obj.empty() || !g_emit_asm.empty() || !g_emit_bc.empty())
+    {
+        if (g_profile_functions)
+        {
+            // 计数器在kal进程中, 提前编译的代码无处可写
+            errs() << argv[0] << ": --profile-functions cannot be used with --emit-obj/--emit-asm/--emit-bc\n";
+            return 1;
+        }
+        auto stream = input.next();
+        status = stream ? compileAOT(stream.get(), g_opt_level - '0') : 1;
+        input.finish();
+    }
+    else
+    {
+        testExpr(input, g_opt_level - '0');
+    }
+    if (g_time_report)
+    {
+        PhaseProfiler::instance().print(errs());
+    }
+    if (g_profile_functions)
+    {
+        FunctionProfiler::instance().print(errs());
+    }
     // testExpr(new StringCharStream("1+2*3-4"));
 
-    return 0;
+    return status;
 }
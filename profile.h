@@ -0,0 +1,297 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+// kal的各个运行阶段
+enum Phase
+{
+    PHASE_LEX,
+    PHASE_PARSE,
+    PHASE_CODEGEN,
+    PHASE_VERIFY,
+    PHASE_OPTIMIZE,
+    PHASE_JIT,
+    PHASE_EXECUTE,
+    PHASE_COUNT
+};
+
+// 进程内operator new的调用次数, 由main.cpp中替换的全局operator new累加
+inline std::atomic<uint64_t> &allocationCount()
+{
+    static std::atomic<uint64_t> count(0);
+    return count;
+}
+
+// 按阶段和顶层item统计耗时与内存分配次数。
+// 阶段可以嵌套，耗时只计入最内层的阶段(比如解析时的词法分析只算作lex)，
+// 因此各阶段相加即为总耗时。每个线程有各自的实例，只统计调用了enable()的线程
+class PhaseProfiler
+{
+public:
+    struct Stats
+    {
+        double seconds[PHASE_COUNT] = {};
+        uint64_t allocations[PHASE_COUNT] = {};
+
+        double totalSeconds() const
+        {
+            double total = 0;
+            for (double s : seconds)
+            {
+                total += s;
+            }
+            return total;
+        }
+        uint64_t totalAllocations() const
+        {
+            uint64_t total = 0;
+            for (uint64_t n : allocations)
+            {
+                total += n;
+            }
+            return total;
+        }
+        void add(const Stats &other)
+        {
+            for (int i = 0; i < PHASE_COUNT; i++)
+            {
+                seconds[i] += other.seconds[i];
+                allocations[i] += other.allocations[i];
+            }
+        }
+    };
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    bool enabled_ = false;
+    std::vector<Phase> stack_;
+    clock::time_point last_;
+    uint64_t lastAllocations_ = 0;
+    // 当前item和所有item的统计
+    Stats item_;
+    Stats total_;
+    std::vector<std::pair<std::string, Stats>> items_;
+
+    // 把上次切换以来的耗时和分配次数计入当前阶段，不在任何阶段中的部分不计
+    void charge()
+    {
+        clock::time_point now = clock::now();
+        uint64_t allocations = allocationCount().load(std::memory_order_relaxed);
+        if (!stack_.empty())
+        {
+            Phase phase = stack_.back();
+            item_.seconds[phase] += std::chrono::duration<double>(now - last_).count();
+            item_.allocations[phase] += allocations - lastAllocations_;
+        }
+        last_ = now;
+        lastAllocations_ = allocations;
+    }
+
+public:
+    static PhaseProfiler &instance()
+    {
+        static thread_local PhaseProfiler profiler;
+        return profiler;
+    }
+
+    static const char *phaseName(Phase phase)
+    {
+        static const char *const names[PHASE_COUNT] = {
+            "lex", "parse", "codegen", "verify", "optimize", "jit", "execute"};
+        return names[phase];
+    }
+
+    void enable()
+    {
+        enabled_ = true;
+        stack_.reserve(16);
+    }
+    bool enabled() const { return enabled_; }
+
+    void enter(Phase phase)
+    {
+        charge();
+        stack_.push_back(phase);
+    }
+    void exit()
+    {
+        charge();
+        stack_.pop_back();
+    }
+
+    // 一个顶层item处理完毕, 以name记录它的统计
+    void endItem(const Twine &name)
+    {
+        if (!enabled_)
+        {
+            return;
+        }
+        charge();
+        total_.add(item_);
+        items_.emplace_back(name.str(), item_);
+        item_ = Stats();
+    }
+
+    void print(raw_ostream &os, size_t max_items = 20)
+    {
+        charge();
+        Stats total = total_;
+        total.add(item_);
+        double seconds = total.totalSeconds();
+
+        os << "===-------------------------------------------------------------===\n"
+           << "                        kal time report\n"
+           << "===-------------------------------------------------------------===\n";
+        os << "  phase           wall (ms)        %       allocs\n";
+        for (int i = 0; i < PHASE_COUNT; i++)
+        {
+            os << format("  %-12s %12.3f %7.1f%% %12llu\n", phaseName((Phase)i),
+                         total.seconds[i] * 1e3,
+                         seconds > 0 ? total.seconds[i] * 100 / seconds : 0.0,
+                         (unsigned long long)total.allocations[i]);
+        }
+        os << format("  total        %12.3f %7.1f%% %12llu\n", seconds * 1e3, 100.0,
+                     (unsigned long long)total.totalAllocations());
+
+        // 最耗时的若干个顶层item
+        std::vector<const std::pair<std::string, Stats> *> items;
+        for (auto &item : items_)
+        {
+            items.push_back(&item);
+        }
+        size_t count = std::min(max_items, items.size());
+        std::partial_sort(items.begin(), items.begin() + count, items.end(),
+                          [](const std::pair<std::string, Stats> *a,
+                             const std::pair<std::string, Stats> *b)
+                          { return a->second.totalSeconds() > b->second.totalSeconds(); });
+        os << format("\n  top %zu of %zu top-level items (ms)\n", count, items.size());
+        os << "  item                         parse   codegen  optimize       jit   execute     allocs\n";
+        for (size_t i = 0; i < count; i++)
+        {
+            const Stats &stats = items[i]->second;
+            os << format("  %-24s %9.3f %9.3f %9.3f %9.3f %9.3f %10llu\n",
+                         items[i]->first.c_str(),
+                         (stats.seconds[PHASE_LEX] + stats.seconds[PHASE_PARSE]) * 1e3,
+                         (stats.seconds[PHASE_CODEGEN] + stats.seconds[PHASE_VERIFY]) * 1e3,
+                         stats.seconds[PHASE_OPTIMIZE] * 1e3,
+                         stats.seconds[PHASE_JIT] * 1e3,
+                         stats.seconds[PHASE_EXECUTE] * 1e3,
+                         (unsigned long long)stats.totalAllocations());
+        }
+        os.flush();
+    }
+};
+
+// 在作用域内把时间记入phase, profiler未启用时只有一次判断
+class PhaseScope
+{
+private:
+    bool active;
+
+public:
+    PhaseScope(Phase phase) : active(PhaseProfiler::instance().enabled())
+    {
+        if (active)
+        {
+            PhaseProfiler::instance().enter(phase);
+        }
+    }
+    ~PhaseScope()
+    {
+        if (active)
+        {
+            PhaseProfiler::instance().exit();
+        }
+    }
+};
+
+// --profile-functions: JIT代码中每个函数定义的调用次数和自身耗时(不含调用其他函数定义的时间,
+// 以CPU周期计)。计数器在宿主进程中, JIT代码经由符号kSymbolPrefix + 函数名访问, 见
+// FunctionAST::emitProfileCounters; 符号解析为计数器的地址, 缓存的目标文件中不含绝对地址。
+// JIT代码用原子指令累加, 可以在多个线程中同时执行
+class FunctionProfiler
+{
+public:
+    // 布局与JIT代码中的[2 x i64]相同
+    struct Counters
+    {
+        uint64_t calls = 0;
+        uint64_t cycles = 0;
+    };
+
+    static constexpr const char *kSymbolPrefix = "__kal_prof.";
+
+private:
+    std::mutex lock_;
+    // deque中的元素地址不变, 重新定义的函数沿用同一组计数器
+    std::deque<std::pair<std::string, Counters>> functions_;
+    StringMap<Counters *> index_;
+
+public:
+    static FunctionProfiler &instance()
+    {
+        static FunctionProfiler profiler;
+        return profiler;
+    }
+
+    // 函数name的计数器, 第一次用到时创建
+    Counters *counters(StringRef name)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        Counters *&slot = index_[name];
+        if (slot == nullptr)
+        {
+            functions_.emplace_back(name.str(), Counters());
+            slot = &functions_.back().second;
+        }
+        return slot;
+    }
+
+    // 应当在JIT代码都执行完之后调用
+    void print(raw_ostream &os, size_t max_functions = 20)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        std::vector<const std::pair<std::string, Counters> *> functions;
+        uint64_t cycles = 0;
+        for (auto &func : functions_)
+        {
+            functions.push_back(&func);
+            cycles += func.second.cycles;
+        }
+        size_t count = std::min(max_functions, functions.size());
+        std::partial_sort(functions.begin(), functions.begin() + count, functions.end(),
+                          [](const std::pair<std::string, Counters> *a,
+                             const std::pair<std::string, Counters> *b)
+                          { return a->second.cycles > b->second.cycles; });
+        os << "===-------------------------------------------------------------===\n"
+           << "                      kal function profile\n"
+           << "===-------------------------------------------------------------===\n";
+        os << format("  top %zu of %zu functions by self cycles\n", count, functions.size());
+        os << "  function                      calls   self Mcycles        %  cycles/call\n";
+        for (size_t i = 0; i < count; i++)
+        {
+            const Counters &counters = functions[i]->second;
+            os << format("  %-24s %10llu %14.3f %7.1f%% %12.1f\n", functions[i]->first.c_str(),
+                         (unsigned long long)counters.calls, counters.cycles / 1e6,
+                         cycles > 0 ? counters.cycles * 100.0 / cycles : 0.0,
+                         counters.calls > 0 ? (double)counters.cycles / counters.calls : 0.0);
+        }
+        os.flush();
+    }
+};